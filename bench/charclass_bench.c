@@ -0,0 +1,106 @@
+/*
+ * Microbenchmark for the string column character-class kernel.
+ *
+ * Compares the per-byte isdigit()/isspace() loop that calculateStringSummaryStats
+ * used to run against countCharClasses() on synthetic columns of short, medium
+ * and long values, and checks that both produce the same counts.
+ *
+ *   make bench && ./bench/charclass_bench [rows]
+ */
+#include "../charclass.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the loop calculateStringSummaryStats ran on every pstrdup'd value */
+static struct CharClassCounts countLegacy(const char *str)
+{
+    struct CharClassCounts counts = { 0, 0, 0 };
+
+    for (int j = 0; str[j] != '\0'; j++) {
+        counts.length++;
+        if (isdigit((unsigned char)str[j])) {
+            counts.digits++;
+        } else if (isspace((unsigned char)str[j])) {
+            counts.whitespace++;
+        }
+    }
+    return counts;
+}
+
+static char **makeColumn(int rows, size_t min_len, size_t max_len, size_t *lengths)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789 \t\n,.-ABCDEF";
+    char **values = malloc(rows * sizeof(char *));
+
+    for (int i = 0; i < rows; i++) {
+        size_t len = min_len + (size_t) rand() % (max_len - min_len + 1);
+        values[i] = malloc(len + 1);
+        for (size_t j = 0; j < len; j++)
+            values[i][j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        values[i][len] = '\0';
+        lengths[i] = len;
+    }
+    return values;
+}
+
+static int runCase(const char *label, int rows, size_t min_len, size_t max_len)
+{
+    size_t *lengths = malloc(rows * sizeof(size_t));
+    char **values   = makeColumn(rows, min_len, max_len, lengths);
+    size_t legacy_digits = 0, legacy_ws = 0, kernel_digits = 0, kernel_ws = 0;
+    size_t bytes = 0;
+
+    double start = nowSeconds();
+    for (int i = 0; i < rows; i++) {
+        struct CharClassCounts c = countLegacy(values[i]);
+        legacy_digits += c.digits;
+        legacy_ws     += c.whitespace;
+        bytes         += c.length;
+    }
+    double legacy_time = nowSeconds() - start;
+
+    start = nowSeconds();
+    for (int i = 0; i < rows; i++) {
+        struct CharClassCounts c = countCharClasses(values[i], lengths[i]);
+        kernel_digits += c.digits;
+        kernel_ws     += c.whitespace;
+    }
+    double kernel_time = nowSeconds() - start;
+
+    int ok = legacy_digits == kernel_digits && legacy_ws == kernel_ws;
+    printf("%-8s rows=%-8d bytes=%-11zu legacy=%8.2f MB/s  kernel=%8.2f MB/s  speedup=%5.2fx  %s\n",
+           label, rows, bytes,
+           bytes / legacy_time / 1e6, bytes / kernel_time / 1e6,
+           legacy_time / kernel_time, ok ? "ok" : "MISMATCH");
+
+    for (int i = 0; i < rows; i++)
+        free(values[i]);
+    free(values);
+    free(lengths);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    int rows = argc > 1 ? atoi(argv[1]) : 200000;
+    int failed = 0;
+
+    srand(42);
+    failed |= runCase("short", rows, 0, 24);
+    failed |= runCase("medium", rows, 32, 256);
+    failed |= runCase("long", rows / 10 > 0 ? rows / 10 : 1, 1024, 8192);
+
+    return failed;
+}
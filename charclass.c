@@ -0,0 +1,196 @@
+#include "charclass.h"
+
+/*
+ * Vectorized digit / whitespace counting for string column statistics.
+ *
+ * The kernels work on raw byte ranges (e.g. a varlena payload) so callers
+ * don't have to produce NUL-terminated copies. On x86-64 the SSE2 kernel is
+ * the baseline and the AVX2 kernel is picked at runtime when the CPU has it;
+ * on aarch64 NEON is used. Everything else falls back to the scalar loop.
+ */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHARCLASS_USE_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CHARCLASS_USE_NEON
+#include <arm_neon.h>
+#endif
+
+
+static inline size_t scalarDigits(const unsigned char *p, size_t len, size_t *whitespace)
+{
+    size_t digits = 0;
+    size_t spaces = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = p[i];
+        digits += (unsigned char)(c - '0') < 10;
+        spaces += (c == ' ') | ((unsigned char)(c - '\t') < 5);
+    }
+
+    *whitespace += spaces;
+    return digits;
+}
+
+struct CharClassCounts countCharClassesScalar(const char *data, size_t len)
+{
+    struct CharClassCounts counts;
+
+    counts.length       = len;
+    counts.whitespace   = 0;
+    counts.digits       = scalarDigits((const unsigned char *) data, len, &counts.whitespace);
+
+    return counts;
+}
+
+
+#ifdef CHARCLASS_USE_X86
+
+/*
+ * Signed byte compares are fine here: '0'..'9' and '\t'..'\r' are all below
+ * 0x80, and bytes >= 0x80 compare as negative so they never fall in range.
+ */
+static struct CharClassCounts countCharClassesSSE2(const char *data, size_t len)
+{
+    const unsigned char *p  = (const unsigned char *) data;
+    const __m128i lo_digit  = _mm_set1_epi8('0' - 1);
+    const __m128i hi_digit  = _mm_set1_epi8('9' + 1);
+    const __m128i lo_space  = _mm_set1_epi8('\t' - 1);
+    const __m128i hi_space  = _mm_set1_epi8('\r' + 1);
+    const __m128i space     = _mm_set1_epi8(' ');
+    struct CharClassCounts counts = { len, 0, 0 };
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v       = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i digit   = _mm_and_si128(_mm_cmpgt_epi8(v, lo_digit), _mm_cmpgt_epi8(hi_digit, v));
+        __m128i ws      = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                       _mm_and_si128(_mm_cmpgt_epi8(v, lo_space), _mm_cmpgt_epi8(hi_space, v)));
+
+        counts.digits       += __builtin_popcount((unsigned) _mm_movemask_epi8(digit));
+        counts.whitespace   += __builtin_popcount((unsigned) _mm_movemask_epi8(ws));
+    }
+
+    counts.digits += scalarDigits(p + i, len - i, &counts.whitespace);
+    return counts;
+}
+
+__attribute__((target("avx2,popcnt")))
+static struct CharClassCounts countCharClassesAVX2(const char *data, size_t len)
+{
+    const unsigned char *p  = (const unsigned char *) data;
+    const __m256i lo_digit  = _mm256_set1_epi8('0' - 1);
+    const __m256i hi_digit  = _mm256_set1_epi8('9' + 1);
+    const __m256i lo_space  = _mm256_set1_epi8('\t' - 1);
+    const __m256i hi_space  = _mm256_set1_epi8('\r' + 1);
+    const __m256i space     = _mm256_set1_epi8(' ');
+    struct CharClassCounts counts = { len, 0, 0 };
+    size_t i = 0;
+
+    /* 64 bytes per iteration: two independent 32-byte lanes */
+    for (; i + 64 <= len; i += 64) {
+        __m256i a       = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i b       = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+        __m256i dig_a   = _mm256_and_si256(_mm256_cmpgt_epi8(a, lo_digit), _mm256_cmpgt_epi8(hi_digit, a));
+        __m256i dig_b   = _mm256_and_si256(_mm256_cmpgt_epi8(b, lo_digit), _mm256_cmpgt_epi8(hi_digit, b));
+        __m256i ws_a    = _mm256_or_si256(_mm256_cmpeq_epi8(a, space),
+                                          _mm256_and_si256(_mm256_cmpgt_epi8(a, lo_space), _mm256_cmpgt_epi8(hi_space, a)));
+        __m256i ws_b    = _mm256_or_si256(_mm256_cmpeq_epi8(b, space),
+                                          _mm256_and_si256(_mm256_cmpgt_epi8(b, lo_space), _mm256_cmpgt_epi8(hi_space, b)));
+
+        unsigned long long dig_mask = (unsigned) _mm256_movemask_epi8(dig_a)
+                                    | ((unsigned long long) (unsigned) _mm256_movemask_epi8(dig_b) << 32);
+        unsigned long long ws_mask  = (unsigned) _mm256_movemask_epi8(ws_a)
+                                    | ((unsigned long long) (unsigned) _mm256_movemask_epi8(ws_b) << 32);
+
+        counts.digits       += __builtin_popcountll(dig_mask);
+        counts.whitespace   += __builtin_popcountll(ws_mask);
+    }
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v       = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i digit   = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo_digit), _mm256_cmpgt_epi8(hi_digit, v));
+        __m256i ws      = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                          _mm256_and_si256(_mm256_cmpgt_epi8(v, lo_space), _mm256_cmpgt_epi8(hi_space, v)));
+
+        counts.digits       += __builtin_popcount((unsigned) _mm256_movemask_epi8(digit));
+        counts.whitespace   += __builtin_popcount((unsigned) _mm256_movemask_epi8(ws));
+    }
+
+    counts.digits += scalarDigits(p + i, len - i, &counts.whitespace);
+    return counts;
+}
+
+static struct CharClassCounts countCharClassesChoose(const char *data, size_t len);
+
+static struct CharClassCounts (*countCharClassesImpl)(const char *data, size_t len) = countCharClassesChoose;
+
+/* resolve the kernel on first use, like the server does for CRC32C */
+static struct CharClassCounts countCharClassesChoose(const char *data, size_t len)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        countCharClassesImpl = countCharClassesAVX2;
+    else
+        countCharClassesImpl = countCharClassesSSE2;
+
+    return countCharClassesImpl(data, len);
+}
+
+struct CharClassCounts countCharClasses(const char *data, size_t len)
+{
+    /* short values (names, codes) aren't worth a vector setup */
+    if (len < 16)
+        return countCharClassesScalar(data, len);
+
+    return countCharClassesImpl(data, len);
+}
+
+#elif defined(CHARCLASS_USE_NEON)
+
+struct CharClassCounts countCharClasses(const char *data, size_t len)
+{
+    const unsigned char *p  = (const unsigned char *) data;
+    const uint8x16_t zero   = vdupq_n_u8('0');
+    const uint8x16_t ten    = vdupq_n_u8(10);
+    const uint8x16_t tab    = vdupq_n_u8('\t');
+    const uint8x16_t five   = vdupq_n_u8(5);
+    const uint8x16_t space  = vdupq_n_u8(' ');
+    struct CharClassCounts counts = { len, 0, 0 };
+    size_t i = 0;
+
+    /*
+     * Matches are 0xFF per lane; accumulate their negation (0 or 1) in u8
+     * lanes for at most 255 blocks before widening into the totals.
+     */
+    while (i + 16 <= len) {
+        uint8x16_t dig_acc  = vdupq_n_u8(0);
+        uint8x16_t ws_acc   = vdupq_n_u8(0);
+        size_t blocks       = 0;
+
+        for (; i + 16 <= len && blocks < 255; i += 16, blocks++) {
+            uint8x16_t v    = vld1q_u8(p + i);
+            uint8x16_t dig  = vcltq_u8(vsubq_u8(v, zero), ten);
+            uint8x16_t ws   = vorrq_u8(vceqq_u8(v, space), vcltq_u8(vsubq_u8(v, tab), five));
+
+            dig_acc = vsubq_u8(dig_acc, dig);
+            ws_acc  = vsubq_u8(ws_acc, ws);
+        }
+
+        counts.digits       += vaddlvq_u8(dig_acc);
+        counts.whitespace   += vaddlvq_u8(ws_acc);
+    }
+
+    counts.digits += scalarDigits(p + i, len - i, &counts.whitespace);
+    return counts;
+}
+
+#else
+
+struct CharClassCounts countCharClasses(const char *data, size_t len)
+{
+    return countCharClassesScalar(data, len);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef CHARCLASS_H
+#define CHARCLASS_H
+
+#include <stddef.h>
+
+/*
+ * Per-string character class counts used by the string column encoder.
+ * Digits are '0'-'9' and whitespace is the C-locale isspace() set
+ * (' ', '\t', '\n', '\v', '\f', '\r').
+ */
+struct CharClassCounts {
+    size_t length;
+    size_t digits;
+    size_t whitespace;
+};
+
+struct CharClassCounts countCharClasses(const char *data, size_t len);
+struct CharClassCounts countCharClassesScalar(const char *data, size_t len);
+
+
+#endif
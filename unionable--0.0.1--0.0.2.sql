@@ -0,0 +1,39 @@
+\echo Use "ALTER EXTENSION unionable UPDATE TO '0.0.2'" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION unionableFindTopKByEncoding(column_names text[], data_types text[], vectors double precision[], k integer,
+                                                       query_table text, query_origin text)
+RETURNS TABLE (table_name text, match_score double precision)
+AS '$libdir/unionable', 'unionableFindTopKByEncoding'
+LANGUAGE C STABLE STRICT;
+
+
+CREATE OR REPLACE FUNCTION unionableFindTopKFederated(text, integer, text[]) RETURNS text
+AS '$libdir/unionable', 'unionableFindTopKFederated'
+LANGUAGE C VOLATILE STRICT;
+
+-- opens connections from the server's OS account; grant explicitly
+REVOKE EXECUTE ON FUNCTION unionableFindTopKFederated(text, integer, text[]) FROM PUBLIC;
+
+
+-- stored encodings (create_encoding() may already have made the table), and
+-- what each table looked like when it was encoded
+DO $$
+BEGIN
+    IF to_regclass('public.encodings') IS NULL THEN
+        CREATE TABLE public.encodings (tbl_name VARCHAR, column_name VARCHAR, data_type VARCHAR, vector DOUBLE PRECISION[]);
+    ELSE
+        ALTER TABLE public.encodings ADD COLUMN IF NOT EXISTS data_type VARCHAR;
+    END IF;
+    IF to_regclass('public.encoding_state') IS NULL THEN
+        CREATE TABLE public.encoding_state (tbl_name VARCHAR PRIMARY KEY, relfilenode OID, mod_count BIGINT,
+                                            column_signature TEXT, refreshed_at TIMESTAMPTZ);
+    END IF;
+END
+$$;
+
+
+CREATE OR REPLACE PROCEDURE refresh_encodings()
+AS '$libdir/unionable', 'refresh_encodings'
+LANGUAGE C
+SECURITY DEFINER
+SET search_path = pg_catalog, pg_temp;
@@ -1,14 +1,36 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "catalog/pg_type.h"
+#include "catalog/pg_class.h"
 
 #include "executor/spi.h"
+#include "access/detoast.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "utils/snapmgr.h"
+#include "tcop/tcopprot.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/latch.h"
+#include "pgstat.h"
 #include <libpq-fe.h>
 
 #include "utils/builtins.h"
 #include "utils/array.h"
 #include "utils/elog.h"
 #include "utils/geo_decls.h"
+#include "utils/lsyscache.h"
+#include "utils/date.h"
+#include "utils/timestamp.h"
+#include "utils/jsonb.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,25 +38,53 @@
 #include <math.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <limits.h>
 
-// #include <limits.h>
 // #include <gsl/gsl_statistics.h>
 #include "utils.h"
-
-
-struct Encoding processColumn(char **column_values, char * data_type, int num_rows, char * column_name, char * table_name);
+#include "charclass.h"
+
+
+/*
+ * Change-detection inputs shared by table enumeration and refresh_encodings():
+ * cumulative plus in-transaction tuple changes, and the live column list.
+ */
+#define MOD_COUNT_SQL(rel) \
+    "pg_stat_get_tuples_inserted(" rel ") + pg_stat_get_tuples_updated(" rel ") + pg_stat_get_tuples_deleted(" rel ") " \
+    "+ pg_stat_get_xact_tuples_inserted(" rel ") + pg_stat_get_xact_tuples_updated(" rel ") + pg_stat_get_xact_tuples_deleted(" rel ")"
+#define COLUMN_SIGNATURE_SQL(rel) \
+    "(SELECT string_agg(a.attname || ':' || a.atttypid, ',' ORDER BY a.attnum) FROM pg_attribute a " \
+    "WHERE a.attrelid = " rel " AND a.attnum > 0 AND NOT a.attisdropped)"
+
+/* stored encodings; the extension scripts own this and public.encoding_state */
+#define ENCODINGS_TABLE_DDL \
+    "CREATE TABLE if not exists public.encodings (tbl_name VARCHAR, column_name VARCHAR, data_type VARCHAR, vector DOUBLE PRECISION[]);"
+
+struct ColumnEncoder;
+struct ColumnState;
+struct QuantizedVector;
+
+struct Encoding processColumn(struct ColumnState *state, char * column_name, char * table_name);
+const struct ColumnEncoder *lookupColumnEncoder(Oid type_oid);
+void initColumnState(struct ColumnState *state, const struct ColumnEncoder *encoder);
+void mergeColumnState(struct ColumnState *dst, const struct ColumnState *src);
 void normalizeVector(double vector[4]);
 void addEncoding(struct Encoding new_encoding);
+static void quantizeEncoding(const struct Encoding *encoding, struct QuantizedVector *code);
 void executeQueries(char * query_table_name);
-void calculateSimilarities(void);
+void encodeQueryTable(char * query_table_name);
+void _PG_init(void);
+int refreshEncodings(void);
+PGDLLEXPORT void unionable_refresh_worker_main(Datum main_arg);
+void calculateSimilarities(int top_k);
 double cosineSimilarity(const double *array1, const double *array2, size_t length);
 int compareValues(const void *a, const void *b);
 int compareSimilarity(const void *a, const void *b);
 int compareMatchScore(const void *a, const void *b);
 double calculatePercentile(double *data, int size, double percentile);
 // double findGreedyMatch(struct Similarities *sorted_similarities, int size);
-struct NumericSummaryStats calculateNumericSummaryStats(char **column_values, int num_values);
-struct StringSummaryStats calculateStringSummaryStats(char **column_values, int num_values);
+struct NumericSummaryStats calculateNumericSummaryStats(double *values, int num_values);
+struct StringSummaryStats calculateStringSummaryStats(struct ColumnState *state);
 
 
 struct Encoding {
@@ -44,6 +94,63 @@ struct Encoding {
     double vector[9];       
 };
 
+/*
+ * Mergeable per-column profile. Every heap relation is scanned once into these;
+ * a partitioned table's profile is the merge of its leaves' profiles.
+ */
+struct ColumnState {
+    const struct ColumnEncoder *encoder;
+    int num_rows;
+    int num_nulls;
+    int num_true;                   // bool
+    double *values;                 // numeric / temporal: one per row, NULL as 0
+    int values_capacity;
+    MemoryContext values_cxt;       // where values lives; encoders run in a per-batch context
+    double length_sum;              // string lengths / jsonb top-level element counts
+    double length_sum_squared;
+    int min_length;
+    int max_length;
+    double total_numerical_ratio;   // string
+    double total_whitespace_ratio;
+    int num_objects;                // jsonb
+    int num_arrays;
+};
+
+/*
+ * Encoders are keyed by type OID and resolved once per table. data_type is the
+ * encoding family: only columns of the same family are ever compared.
+ */
+typedef void (*ColumnAccumulateFn)(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows);
+typedef void (*ColumnFinalizeFn)(struct ColumnState *state, double vector[9]);
+
+struct ColumnEncoder {
+    char * data_type;
+    ColumnAccumulateFn accumulate;
+    ColumnFinalizeFn finalize;
+};
+
+/* one profiled heap relation (a plain table or a leaf partition) */
+struct RelationProfile {
+    int num_columns;
+    char **column_names;
+    struct ColumnState *states;
+};
+
+/* cached leaf partition profile, reused while the leaf is unchanged */
+struct LeafProfileCacheEntry {
+    Oid relid;                      // hash key
+    Oid relfilenode;
+    int64 mod_count;
+    int64 rel_size;
+    char *column_signature;
+    bool toast_aware;               // string stats depend on these GUCs
+    int toast_prefix;
+    struct RelationProfile profile;
+    MemoryContext cxt;
+    int64 bytes;                    // charged against partition_profile_cache_limit
+    uint64 generation;              // last executeQueries() that listed the leaf
+};
+
 struct ColumnNode {
     char * table_name;
     char * attr_name;
@@ -63,6 +170,16 @@ struct TableRanks {
     double match_score
 };
 
+/*
+ * int8 scalar-quantized copy of a unit-length encoding vector, kept next to the
+ * exact encoding (10 more bytes per column) so score bounds can be computed
+ * from a dense array. family indexes encoding_families.
+ */
+struct QuantizedVector {
+    int8 codes[9];
+    uint8 family;
+};
+
 struct NumericSummaryStats{
     double count;
     double mean;
@@ -89,6 +206,7 @@ struct StringSummaryStats{
 
 struct Encoding* candidate_encodings_array          = NULL;
 struct Encoding* query_encodings_array              = NULL;
+struct QuantizedVector* candidate_codes_array       = NULL;     // parallel to candidate_encodings_array
 struct Similarities * similarity_tuples             = NULL;
 struct TableRanks * table_ranks                     = NULL;
 
@@ -100,6 +218,23 @@ size_t num_similarity_tuples                        = 0;
 int *num_columns_array                              = NULL;
 int size_of_num_columns_array                       = 0;
 
+HTAB *leaf_profile_cache                            = NULL;
+int64 leaf_profile_cache_bytes                      = 0;
+uint64 leaf_profile_cache_generation                = 0;
+
+/* GUCs */
+bool toast_aware_stats                              = false;
+int toast_prefix_bytes                              = 1024;
+bool rank_leaf_partitions                           = true;
+bool cache_partition_profiles                       = false;
+int partition_profile_cache_limit                   = 64 * 1024;
+bool quantized_search                               = false;
+int refresh_threshold                               = 50;
+double refresh_scale_factor                         = 0.1;
+int refresh_io_budget                               = 1024 * 1024;
+int refresh_interval                                = 0;
+char *refresh_database                              = NULL;
+
 
 double cosineSimilarity(const double *array1, const double *array2, size_t length) {
     /*
@@ -132,60 +267,378 @@ void normalizeVector(double vector[9]) {
     }
 }
 
-struct Encoding processColumn(char **column_values, char * data_type, int num_rows, char * column_name, char * table_name) {
+void initColumnState(struct ColumnState *state, const struct ColumnEncoder *encoder) {
+    memset(state, 0, sizeof(struct ColumnState));
+    state->encoder              = encoder;
+    state->min_length           = INT_MAX;
+    state->values_cxt           = CurrentMemoryContext;
+}
 
-    struct Encoding column;
-    if (strcmp(data_type, "varchar") == 0)
-    {
-        struct StringSummaryStats stats     = calculateStringSummaryStats(column_values, num_rows);
-        column.table_name                   = table_name;
-        column.column_name                  = column_name;
-        column.data_type                    = "text";
-        column.vector[0]                    = stats.count;             // count
-        column.vector[1]                    = stats.mean;              // mean
-        column.vector[2]                    = stats.stddev;            // stddev
-        column.vector[3]                    = stats.min;               // min
-        column.vector[4]                    = stats.average_numerical_chars_ratio; // average_numerical_chars_ratio
-        column.vector[5]                    = stats.average_whitespace_ratio;      // average_whitespace_ratio
-        column.vector[6]                    = stats.max;               // max
-        column.vector[7]                    = stats.range;             // range
-        column.vector[8]                    = stats.range;             // range
-        normalizeVector(column.vector);
-    }
-    else if ((strcmp(data_type, "numeric") == 0) || (strstr(data_type, "int")))
-    {
-        struct NumericSummaryStats stats   = calculateNumericSummaryStats(column_values, num_rows);
-        column.table_name           = table_name;
-        column.column_name          = column_name;
-        column.data_type            = "numeric";
-        column.vector[0]            = stats.count;             // count
-        column.vector[1]            = stats.mean;              // mean
-        column.vector[2]            = stats.stddev * stats.stddev ;  // stddev
-        column.vector[3]            = stats.min;               // min
-        column.vector[4]            = stats.percentile_25;     // percentile25
-        column.vector[5]            = stats.median;            // median
-        column.vector[6]            = stats.percentile_75;     // percentile_75
-        column.vector[7]            = stats.max;               // max
-        column.vector[8]            = stats.range;             // range
-        normalizeVector(column.vector);
-    }
-    else 
+/* room for num_rows more values; the array lives in the state's context, not the batch's */
+static double *reserveColumnValues(struct ColumnState *state, int num_rows) {
+    int needed = state->num_rows + num_rows;
+    if (needed > state->values_capacity) {
+        int new_capacity = Max(needed, state->values_capacity * 2);
+        if (state->values == NULL) {
+            state->values = (double *)MemoryContextAllocHuge(state->values_cxt, Max(new_capacity, 1) * sizeof(double));
+        } else {
+            state->values = (double *)repalloc_huge(state->values, new_capacity * sizeof(double));
+        }
+        state->values_capacity = new_capacity;
+    }
+    return state->values + state->num_rows;
+}
+
+void mergeColumnState(struct ColumnState *dst, const struct ColumnState *src) {
+    if (dst->encoder != src->encoder) {
+        elog(ERROR, "Cannot merge column profiles of different types");
+    }
+    if (src->values != NULL) {
+        memcpy(reserveColumnValues(dst, src->num_rows), src->values, src->num_rows * sizeof(double));
+    }
+    dst->num_rows               += src->num_rows;
+    dst->num_nulls              += src->num_nulls;
+    dst->num_true               += src->num_true;
+    dst->length_sum             += src->length_sum;
+    dst->length_sum_squared     += src->length_sum_squared;
+    dst->min_length             = Min(dst->min_length, src->min_length);
+    dst->max_length             = Max(dst->max_length, src->max_length);
+    dst->total_numerical_ratio  += src->total_numerical_ratio;
+    dst->total_whitespace_ratio += src->total_whitespace_ratio;
+    dst->num_objects            += src->num_objects;
+    dst->num_arrays             += src->num_arrays;
+}
+
+static void fillNumericVector(double *values, int num_rows, double vector[9]) {
+    struct NumericSummaryStats stats   = calculateNumericSummaryStats(values, num_rows);
+    vector[0]            = stats.count;             // count
+    vector[1]            = stats.mean;              // mean
+    vector[2]            = stats.stddev * stats.stddev ;  // stddev
+    vector[3]            = stats.min;               // min
+    vector[4]            = stats.percentile_25;     // percentile25
+    vector[5]            = stats.median;            // median
+    vector[6]            = stats.percentile_75;     // percentile_75
+    vector[7]            = stats.max;               // max
+    vector[8]            = stats.range;             // range
+}
+
+static void finalizeNumericColumn(struct ColumnState *state, double vector[9]) {
+    fillNumericVector(state->values, state->num_rows, vector);
+}
+
+/*
+ * bpchar values are profiled without their pad spaces, so a char(n) column's
+ * whitespace ratio reflects its contents rather than n.
+ */
+static inline void accumulateTextValues(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows,
+                                        bool strip_padding) {
+    // Iterate through each value, reading the varlena payload in place
+    for (int i = 0; i < num_rows; i++) {
+        if (column_nulls[i]) {
+            state->num_nulls++;
+            continue; // Skip NULL strings
+        }
+
+        struct varlena *raw     = (struct varlena *) DatumGetPointer(column_datums[i]);
+        struct varlena *value;
+        struct CharClassCounts counts;
+        int total_chars;
+
+        /* padding can't be stripped from a prefix slice, so TOASTed bpchar is read in full */
+        if (toast_aware_stats && !strip_padding && VARATT_IS_EXTENDED(raw) && !VARATT_IS_SHORT(raw)) {
+            /*
+             * Compressed or out-of-line: the raw length is in the TOAST header,
+             * and the character mix is estimated from a prefix slice so only
+             * the first chunk(s) get fetched and decompressed.
+             */
+            total_chars         = (int) (toast_raw_datum_size(column_datums[i]) - VARHDRSZ);
+            value               = (struct varlena *) PG_DETOAST_DATUM_SLICE(column_datums[i], 0, toast_prefix_bytes);
+            counts              = countCharClasses(VARDATA_ANY(value), VARSIZE_ANY_EXHDR(value));
+            if (counts.length > 0 && counts.length < (size_t) total_chars) {
+                double scale        = (double) total_chars / counts.length;
+                counts.digits       = (size_t) (counts.digits * scale + 0.5);
+                counts.whitespace   = (size_t) (counts.whitespace * scale + 0.5);
+            }
+        }
+        else {
+            int len;
+
+            value               = PG_DETOAST_DATUM_PACKED(column_datums[i]);
+            len                 = (int) VARSIZE_ANY_EXHDR(value);
+            if (strip_padding) {
+                len             = bpchartruelen(VARDATA_ANY(value), len);
+            }
+            counts              = countCharClasses(VARDATA_ANY(value), len);
+            total_chars         = (int) counts.length;
+        }
+
+        // Update min and max lengths
+        if (total_chars < state->min_length) state->min_length = total_chars;
+        if (total_chars > state->max_length) state->max_length = total_chars;
+
+        // Accumulate length statistics
+        state->length_sum += total_chars;
+        state->length_sum_squared += (double) total_chars * total_chars;
+
+        // Calculate ratios for this string
+        if (total_chars > 0) { // Avoid division by zero for empty strings
+            state->total_numerical_ratio += (double)counts.digits / total_chars;
+            state->total_whitespace_ratio += (double)counts.whitespace / total_chars;
+        }
+    }
+    state->num_rows += num_rows;
+}
+
+static void accumulateStringColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    accumulateTextValues(state, column_datums, column_nulls, num_rows, false);
+}
+
+static void accumulateBpcharColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    accumulateTextValues(state, column_datums, column_nulls, num_rows, true);
+}
+
+/*
+ * jsonb is profiled by shape: the root container's kind and element count.
+ * Both live in the first word of the container, so only that prefix is
+ * detoasted.
+ */
+static void accumulateJsonbColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    for (int i = 0; i < num_rows; i++) {
+        if (column_nulls[i]) {
+            state->num_nulls++;
+            continue;
+        }
+
+        Jsonb *jb           = (Jsonb *) PG_DETOAST_DATUM_SLICE(column_datums[i], 0, sizeof(uint32));
+        int num_elements    = JB_ROOT_IS_SCALAR(jb) ? 1 : (int) JB_ROOT_COUNT(jb);
+
+        state->num_objects  += JB_ROOT_IS_OBJECT(jb);
+        state->num_arrays   += JB_ROOT_IS_ARRAY(jb) && !JB_ROOT_IS_SCALAR(jb);
+
+        if (num_elements < state->min_length) state->min_length = num_elements;
+        if (num_elements > state->max_length) state->max_length = num_elements;
+        state->length_sum += num_elements;
+        state->length_sum_squared += (double) num_elements * num_elements;
+    }
+    state->num_rows += num_rows;
+}
+
+static void finalizeJsonbColumn(struct ColumnState *state, double vector[9]) {
+    int num_values  = state->num_rows - state->num_nulls;
+    double denom    = num_values > 0 ? num_values : 1;
+    double mean     = state->length_sum / denom;
+
+    vector[0]       = state->num_rows;                                              // count
+    vector[1]       = mean;                                                         // mean element count
+    vector[2]       = state->length_sum_squared / denom - mean * mean;              // element count variance
+    vector[3]       = num_values > 0 ? state->min_length : 0;                       // min element count
+    vector[4]       = num_values > 0 ? state->max_length : 0;                       // max element count
+    vector[5]       = state->num_objects / denom;                                   // object ratio
+    vector[6]       = state->num_arrays / denom;                                    // array ratio
+    vector[7]       = (num_values - state->num_objects - state->num_arrays) / denom; // scalar ratio
+    vector[8]       = (double) state->num_nulls / state->num_rows;                  // null ratio
+}
+
+static void finalizeStringColumn(struct ColumnState *state, double vector[9]) {
+    struct StringSummaryStats stats     = calculateStringSummaryStats(state);
+    vector[0]                    = stats.count;             // count
+    vector[1]                    = stats.mean;              // mean
+    vector[2]                    = stats.stddev;            // stddev
+    vector[3]                    = stats.min;               // min
+    vector[4]                    = stats.average_numerical_chars_ratio; // average_numerical_chars_ratio
+    vector[5]                    = stats.average_whitespace_ratio;      // average_whitespace_ratio
+    vector[6]                    = stats.max;               // max
+    vector[7]                    = stats.range;             // range
+    vector[8]                    = stats.range;             // range
+}
+
+/*
+ * By-value types: heap_deform_tuple leaves a zero Datum for NULLs, which reads as 0 for
+ * every type below, so the loops need no null branch (NULL counts as 0, as the
+ * old atof() path did).
+ */
+#define DEFINE_BYVAL_NUMERIC_ACCUMULATOR(fn_name, datum_to_double) \
+static void fn_name(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) { \
+    double *values = reserveColumnValues(state, num_rows); \
+    for (int i = 0; i < num_rows; i++) { \
+        values[i] = (double) datum_to_double(column_datums[i]); \
+    } \
+    state->num_rows += num_rows; \
+}
+
+DEFINE_BYVAL_NUMERIC_ACCUMULATOR(accumulateInt2Column, DatumGetInt16)
+DEFINE_BYVAL_NUMERIC_ACCUMULATOR(accumulateInt4Column, DatumGetInt32)
+DEFINE_BYVAL_NUMERIC_ACCUMULATOR(accumulateInt8Column, DatumGetInt64)
+
+/* NaN and +-Infinity would poison the mean and the normalized vector, so they count as NULL */
+#define DEFINE_BYVAL_FLOAT_ACCUMULATOR(fn_name, datum_to_double) \
+static void fn_name(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) { \
+    double *values = reserveColumnValues(state, num_rows); \
+    for (int i = 0; i < num_rows; i++) { \
+        double value = (double) datum_to_double(column_datums[i]); \
+        values[i]    = isfinite(value) ? value : 0.0; \
+    } \
+    state->num_rows += num_rows; \
+}
+
+DEFINE_BYVAL_FLOAT_ACCUMULATOR(accumulateFloat4Column, DatumGetFloat4)
+DEFINE_BYVAL_FLOAT_ACCUMULATOR(accumulateFloat8Column, DatumGetFloat8)
+
+static void accumulateNumericColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    double *values = reserveColumnValues(state, num_rows);
+    for (int i = 0; i < num_rows; i++) {
+        double value = column_nulls[i] ? 0.0 :
+            DatumGetFloat8(DirectFunctionCall1(numeric_float8_no_overflow, column_datums[i]));
+        values[i]    = isfinite(value) ? value : 0.0;   // NaN / Infinity count as NULL
+    }
+    state->num_rows += num_rows;
+}
+
+/* dates and timestamps are profiled as seconds since the Unix epoch */
+#define UNIX_EPOCH_OFFSET_SECS ((double) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)
+
+static void accumulateDateColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    double *values = reserveColumnValues(state, num_rows);
+    for (int i = 0; i < num_rows; i++) {
+        DateADT date = DatumGetDateADT(column_datums[i]);
+        bool valid   = !column_nulls[i] && !DATE_NOT_FINITE(date);
+        values[i]    = valid * ((double) date * SECS_PER_DAY + UNIX_EPOCH_OFFSET_SECS);
+    }
+    state->num_rows += num_rows;
+}
+
+static void accumulateTimestampColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    double *values = reserveColumnValues(state, num_rows);
+    for (int i = 0; i < num_rows; i++) {
+        Timestamp ts = DatumGetTimestamp(column_datums[i]);
+        bool valid   = !column_nulls[i] && !TIMESTAMP_NOT_FINITE(ts);
+        values[i]    = valid * ((double) ts / USECS_PER_SEC + UNIX_EPOCH_OFFSET_SECS);
+    }
+    state->num_rows += num_rows;
+}
+
+static void accumulateBoolColumn(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    for (int i = 0; i < num_rows; i++) {
+        state->num_true  += DatumGetBool(column_datums[i]);   // NULLs come back as false
+        state->num_nulls += column_nulls[i];
+    }
+    state->num_rows += num_rows;
+}
+
+static void finalizeBoolColumn(struct ColumnState *state, double vector[9]) {
+    double denom  = state->num_rows > 0 ? state->num_rows : 1;
+    vector[0]     = state->num_rows;                                            // count
+    vector[1]     = state->num_true / denom;                                    // true ratio
+    vector[2]     = (state->num_rows - state->num_true - state->num_nulls) / denom; // false ratio
+    vector[3]     = state->num_nulls / denom;                                   // null ratio
+    vector[4]     = 0.0;
+    vector[5]     = 0.0;
+    vector[6]     = 0.0;
+    vector[7]     = 0.0;
+    vector[8]     = 0.0;
+}
+
+/* uuid and unknown columns only track row and null counts */
+static void accumulateCounts(struct ColumnState *state, Datum *column_datums, bool *column_nulls, int num_rows) {
+    for (int i = 0; i < num_rows; i++) {
+        state->num_nulls += column_nulls[i];
+    }
+    state->num_rows += num_rows;
+}
+
+/* uuids carry no value distribution worth profiling, only count and null ratio */
+static void finalizeUuidColumn(struct ColumnState *state, double vector[9]) {
+    vector[0]     = state->num_rows;                                                        // count
+    vector[1]     = state->num_rows > 0 ? (double) state->num_nulls / state->num_rows : 0.0; // null ratio
+    vector[2]     = 1.0;
+    for (int i = 3; i < 9; i++) {
+        vector[i] = 0.0;
+    }
+}
+
+static void finalizeUnknownColumn(struct ColumnState *state, double vector[9]) {
+    vector[0]            = state->num_rows;         // count
+    vector[1]            = 10.0;        // mean
+    vector[2]            = 0.0;         // stddev
+    vector[3]            = 10.0;         // min
+    vector[4]            = 10.0;         // percentile25
+    vector[5]            = 10.0;        // median
+    vector[6]            = 10.0;        // percentile_75
+    vector[7]            = 10.0;        // max
+    vector[8]            = 0.0;        // range
+}
+
+static const struct ColumnEncoder string_encoder     = { "text",     accumulateStringColumn,    finalizeStringColumn };
+static const struct ColumnEncoder bpchar_encoder     = { "text",     accumulateBpcharColumn,    finalizeStringColumn };
+static const struct ColumnEncoder jsonb_encoder      = { "jsonb",    accumulateJsonbColumn,     finalizeJsonbColumn };
+static const struct ColumnEncoder int2_encoder       = { "numeric",  accumulateInt2Column,      finalizeNumericColumn };
+static const struct ColumnEncoder int4_encoder       = { "numeric",  accumulateInt4Column,      finalizeNumericColumn };
+static const struct ColumnEncoder int8_encoder       = { "numeric",  accumulateInt8Column,      finalizeNumericColumn };
+static const struct ColumnEncoder float4_encoder     = { "numeric",  accumulateFloat4Column,    finalizeNumericColumn };
+static const struct ColumnEncoder float8_encoder     = { "numeric",  accumulateFloat8Column,    finalizeNumericColumn };
+static const struct ColumnEncoder numeric_encoder    = { "numeric",  accumulateNumericColumn,   finalizeNumericColumn };
+static const struct ColumnEncoder date_encoder       = { "temporal", accumulateDateColumn,      finalizeNumericColumn };
+static const struct ColumnEncoder timestamp_encoder  = { "temporal", accumulateTimestampColumn, finalizeNumericColumn };
+static const struct ColumnEncoder bool_encoder       = { "boolean",  accumulateBoolColumn,      finalizeBoolColumn };
+static const struct ColumnEncoder uuid_encoder       = { "uuid",     accumulateCounts,          finalizeUuidColumn };
+static const struct ColumnEncoder unknown_encoder    = { "unknown",  accumulateCounts,          finalizeUnknownColumn };
+
+const struct ColumnEncoder *lookupColumnEncoder(Oid type_oid) {
+    /* domains are encoded like their base type */
+    switch (getBaseType(type_oid))
     {
-        // elog(INFO, "UNKNOWN TYPE: %s in table: %s as column: %s", data_type, table_name, column_name); // UNCOMMENT
-        column.table_name           = table_name;
-        column.column_name          = column_name;
-        column.data_type            = "unknown";
-        column.vector[0]            = num_rows;         // count
-        column.vector[1]            = 10.0;        // mean
-        column.vector[2]            = 0.0;         // stddev
-        column.vector[3]            = 10.0;         // min
-        column.vector[4]            = 10.0;         // percentile25
-        column.vector[5]            = 10.0;        // median
-        column.vector[6]            = 10.0;        // percentile_75
-        column.vector[7]            = 10.0;        // max
-        column.vector[8]            = 0.0;        // range
-        normalizeVector(column.vector);
+        case TEXTOID:
+        case VARCHAROID:
+        case JSONOID:
+            return &string_encoder;
+        case BPCHAROID:
+            return &bpchar_encoder;
+        case JSONBOID:
+            return &jsonb_encoder;
+        case INT2OID:
+            return &int2_encoder;
+        case INT4OID:
+            return &int4_encoder;
+        case INT8OID:
+            return &int8_encoder;
+        case FLOAT4OID:
+            return &float4_encoder;
+        case FLOAT8OID:
+            return &float8_encoder;
+        case NUMERICOID:
+            return &numeric_encoder;
+        case DATEOID:
+            return &date_encoder;
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            return &timestamp_encoder;
+        case BOOLOID:
+            return &bool_encoder;
+        case UUIDOID:
+            return &uuid_encoder;
+        default:
+            return &unknown_encoder;
+    }
+}
+
+struct Encoding processColumn(struct ColumnState *state, char * column_name, char * table_name) {
+
+    struct Encoding column;
+    column.table_name           = table_name;
+    column.column_name          = column_name;
+    column.data_type            = state->encoder->data_type;
+
+    /*
+     * An empty column has no distribution to profile: it gets the constant
+     * vector and is only compared with other columns that have one.
+     */
+    if (state->num_rows == 0) {
+        column.data_type        = unknown_encoder.data_type;
+        finalizeUnknownColumn(state, column.vector);
+    } else {
+        state->encoder->finalize(state, column.vector);
     }
+    normalizeVector(column.vector);
     return column;
 }
 
@@ -201,12 +654,341 @@ void addEncoding(struct Encoding new_encoding) {
             exit(1);
         }
         candidate_encodings_array = temp;
+
+        if (quantized_search) {
+            struct QuantizedVector* codes   = realloc(candidate_codes_array, capacity * sizeof(struct QuantizedVector));
+            if (!codes) {
+                elog(ERROR, "Memory allocation failed");
+            }
+            candidate_codes_array = codes;
+        }
     }
 
+    /* the int8 arena is filled as columns are encoded, and is all the first pass reads */
+    if (quantized_search) {
+        quantizeEncoding(&new_encoding, &candidate_codes_array[num_candidate_attrs]);
+    }
     candidate_encodings_array[num_candidate_attrs++] = new_encoding;
 }
 
 
+/* rows fetched, deformed and handed to the encoders at a time */
+#define PROFILE_BATCH_ROWS 1024
+
+/*
+ * Profile every column of a relation into mergeable column states. With
+ * scan_rows false only the columns and their encoders are set up (used for
+ * partitioned tables, whose rows are profiled through their leaves).
+ *
+ * The relation is named by OID and spliced into SQL only as a quoted,
+ * schema-qualified identifier, since callers may run as a definer or superuser.
+ *
+ * Only columns whose encoder reads values are selected. Rows come through a
+ * cursor in batches; each tuple is deformed once into per-column batch buffers
+ * that the encoders then consume column by column.
+ */
+static bool profileRelation(Oid relid, bool scan_rows, struct RelationProfile *profile) {
+
+    char *relname                       = get_rel_name(relid);
+    char *nspname                       = get_namespace_name(get_rel_namespace(relid));
+    if (relname == NULL || nspname == NULL) {
+        elog(WARNING, "Relation %u no longer exists", relid);
+        return false;
+    }
+    const char *table_name              = quote_qualified_identifier(nspname, relname);
+
+    char data_query[1024];
+    snprintf(data_query, sizeof(data_query), "SELECT * FROM %s LIMIT 0;", table_name);
+
+    int ret_data                        = SPI_execute(data_query, true, 0);
+    if (ret_data != SPI_OK_SELECT) {
+        elog(WARNING, "Could not fetch data from table %s", table_name);
+        return false;
+    }
+
+    TupleDesc data_tupdesc              = SPI_tuptable->tupdesc;
+    int num_columns                     = data_tupdesc->natts;
+
+    profile->num_columns                = num_columns;
+    profile->column_names               = (char **)palloc(Max(num_columns, 1) * sizeof(char *));
+    profile->states                     = (struct ColumnState *)palloc(Max(num_columns, 1) * sizeof(struct ColumnState));
+
+    /* resolve each column's encoder once per table */
+    for (int i = 1; i <= num_columns; i++) {
+        profile->column_names[i-1]      = SPI_fname(data_tupdesc, i);
+        initColumnState(&profile->states[i-1], lookupColumnEncoder(SPI_gettypeid(data_tupdesc, i)));
+    }
+    SPI_freetuptable(SPI_tuptable);
+
+    if (!scan_rows) {
+        return true;
+    }
+
+    /* "unknown" columns only need the row count, so leave them out of the scan */
+    StringInfoData scan_query;
+    int *projected                      = (int *)palloc(Max(num_columns, 1) * sizeof(int));
+    int num_projected                   = 0;
+
+    initStringInfo(&scan_query);
+    appendStringInfoString(&scan_query, "SELECT ");
+    for (int i = 0; i < num_columns; i++) {
+        if (profile->states[i].encoder != &unknown_encoder) {
+            appendStringInfo(&scan_query, "%s%s", num_projected > 0 ? ", " : "", quote_identifier(profile->column_names[i]));
+            projected[num_projected++]  = i;
+        }
+    }
+    appendStringInfo(&scan_query, " FROM %s", table_name);
+
+    SPIPlanPtr plan                     = SPI_prepare(scan_query.data, 0, NULL);
+    if (plan == NULL) {
+        elog(WARNING, "Could not fetch data from table %s", table_name);
+        return false;
+    }
+    Portal portal                       = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+    /*
+     * Encoders run in a context reset after every batch, so detoasted copies
+     * (text, jsonb prefixes, numerics) never outlive the batch they came from.
+     */
+    MemoryContext batch_cxt             = AllocSetContextCreate(CurrentMemoryContext, "unionable profile batch", ALLOCSET_DEFAULT_SIZES);
+
+    /* columnar batch buffers, reused for every batch */
+    Datum *row_values                   = (Datum *)palloc(Max(num_projected, 1) * sizeof(Datum));
+    bool *row_nulls                     = (bool *)palloc(Max(num_projected, 1) * sizeof(bool));
+    Datum *batch_values                 = (Datum *)palloc(Max(num_projected, 1) * PROFILE_BATCH_ROWS * sizeof(Datum));
+    bool *batch_nulls                   = (bool *)palloc(Max(num_projected, 1) * PROFILE_BATCH_ROWS * sizeof(bool));
+
+    for (;;) {
+        SPI_cursor_fetch(portal, true, PROFILE_BATCH_ROWS);
+
+        SPITupleTable *batch            = SPI_tuptable;
+        int num_rows                    = (int) SPI_processed;
+
+        if (num_rows == 0) {
+            SPI_freetuptable(batch);
+            break;
+        }
+
+        for (int k = 0; k < num_rows; k++) {
+            heap_deform_tuple(batch->vals[k], batch->tupdesc, row_values, row_nulls);
+            for (int c = 0; c < num_projected; c++) {
+                batch_values[c * PROFILE_BATCH_ROWS + k] = row_values[c];
+                batch_nulls[c * PROFILE_BATCH_ROWS + k]  = row_nulls[c];
+            }
+        }
+
+        /* datums point into the batch's tuples, so encode before freeing it */
+        MemoryContext old_cxt           = MemoryContextSwitchTo(batch_cxt);
+        for (int c = 0; c < num_projected; c++) {
+            struct ColumnState *state   = &profile->states[projected[c]];
+            state->encoder->accumulate(state, &batch_values[c * PROFILE_BATCH_ROWS], &batch_nulls[c * PROFILE_BATCH_ROWS], num_rows);
+        }
+        MemoryContextSwitchTo(old_cxt);
+        for (int i = 0; i < num_columns; i++) {
+            if (profile->states[i].encoder == &unknown_encoder) {
+                profile->states[i].num_rows += num_rows;
+            }
+        }
+
+        SPI_freetuptable(batch);
+        MemoryContextReset(batch_cxt);
+    }
+
+    SPI_cursor_close(portal);
+    MemoryContextDelete(batch_cxt);
+    SPI_freeplan(plan);
+
+    pfree(scan_query.data);
+    pfree(projected);
+    pfree(row_values);
+    pfree(row_nulls);
+    pfree(batch_values);
+    pfree(batch_nulls);
+    return true;
+}
+
+/* fold a leaf partition's profile into its root, matching columns by name */
+static void mergeRelationProfile(struct RelationProfile *root, const struct RelationProfile *leaf) {
+    for (int i = 0; i < root->num_columns; i++) {
+        for (int j = 0; j < leaf->num_columns; j++) {
+            if (strcmp(root->column_names[i], leaf->column_names[j]) == 0) {
+                mergeColumnState(&root->states[i], &leaf->states[j]);
+                break;
+            }
+        }
+    }
+}
+
+/* copy of a name in the caller's context, so encodings outlive SPI_finish */
+static char *spiUpperStrdup(const char *str) {
+    size_t len                          = strlen(str) + 1;
+    char *copy                          = (char *)SPI_palloc(len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+/* finalize a profile into the query table's encodings or a new candidate table */
+static void emitEncodings(char *table_name, char *query_table_name, struct RelationProfile *profile) {
+    int num_columns                     = profile->num_columns;
+
+    table_name                          = spiUpperStrdup(table_name);
+
+    if (query_table_name != NULL && strcmp(table_name, query_table_name) == 0)
+    {
+        query_encodings_array = realloc(query_encodings_array, sizeof(struct Encoding) * num_columns);
+        if (query_encodings_array == NULL) {
+            elog(ERROR, "Memory allocation failed");
+            free(query_encodings_array);
+            exit(1);
+        }
+        num_query_attrs = (size_t) num_columns;
+        num_columns_array[size_of_num_columns_array++] = 0;
+
+        for (int i = 0; i < num_columns; i++) {
+            query_encodings_array[i]    = processColumn(&profile->states[i], spiUpperStrdup(profile->column_names[i]), table_name);
+        }
+    }
+    else
+    {
+        num_columns_array[size_of_num_columns_array++] = num_columns;
+
+        for (int i = 0; i < num_columns; i++) {
+            addEncoding(processColumn(&profile->states[i], spiUpperStrdup(profile->column_names[i]), table_name));
+        }
+    }
+}
+
+/* a partitioned table without rows (no leaves, or only empty ones) is not ranked */
+static void emitRootEncodings(char *root_name, char *query_table_name, struct RelationProfile *root_profile) {
+    bool has_rows                       = root_profile->num_columns > 0 && root_profile->states[0].num_rows > 0;
+
+    if (has_rows || (query_table_name != NULL && strcmp(root_name, query_table_name) == 0)) {
+        emitEncodings(root_name, query_table_name, root_profile);
+    }
+}
+
+/*
+ * Leaf partition profiles can be kept for the rest of the session
+ * (unionable.cache_partition_profiles), so a partitioned table is refreshed by
+ * re-profiling only the leaves whose relfilenode, size, modification count or
+ * column list changed since they were cached. The modification count comes from
+ * the cumulative statistics, which only see other sessions' commits once they
+ * are flushed and don't move at all with track_counts off; the size catches
+ * growth and truncation regardless, but not in-place updates.
+ */
+static void removeLeafProfile(struct LeafProfileCacheEntry *entry) {
+    leaf_profile_cache_bytes            -= entry->bytes;
+    MemoryContextDelete(entry->cxt);
+    hash_search(leaf_profile_cache, &entry->relid, HASH_REMOVE, NULL);
+}
+
+/* drop every cached leaf, or only those the current enumeration didn't list (dropped or detached) */
+static void evictLeafProfiles(bool all) {
+    HASH_SEQ_STATUS status;
+    struct LeafProfileCacheEntry *entry;
+
+    if (leaf_profile_cache == NULL) {
+        return;
+    }
+
+    hash_seq_init(&status, leaf_profile_cache);
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        if (all || entry->generation != leaf_profile_cache_generation) {
+            removeLeafProfile(entry);
+        }
+    }
+}
+
+static struct RelationProfile *lookupLeafProfile(Oid relid, Oid relfilenode, int64 mod_count, int64 rel_size, char *column_signature) {
+    if (!cache_partition_profiles || leaf_profile_cache == NULL) {
+        return NULL;
+    }
+
+    struct LeafProfileCacheEntry *entry = hash_search(leaf_profile_cache, &relid, HASH_FIND, NULL);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->relfilenode != relfilenode || entry->mod_count != mod_count || entry->rel_size != rel_size ||
+        entry->toast_aware != toast_aware_stats || entry->toast_prefix != toast_prefix_bytes ||
+        strcmp(entry->column_signature, column_signature) != 0) {
+        removeLeafProfile(entry);
+        return NULL;
+    }
+    entry->generation                   = leaf_profile_cache_generation;
+    return &entry->profile;
+}
+
+static void storeLeafProfile(Oid relid, Oid relfilenode, int64 mod_count, int64 rel_size, char *column_signature, const struct RelationProfile *profile) {
+    if (!cache_partition_profiles) {
+        return;
+    }
+
+    if (leaf_profile_cache == NULL) {
+        HASHCTL ctl;
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize                     = sizeof(Oid);
+        ctl.entrysize                   = sizeof(struct LeafProfileCacheEntry);
+        ctl.hcxt                        = TopMemoryContext;
+        leaf_profile_cache              = hash_create("unionable leaf profiles", 64, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    /* copy everything into the entry's own context before touching the hash */
+    MemoryContext cxt                   = AllocSetContextCreate(TopMemoryContext, "unionable leaf profile", ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_cxt               = MemoryContextSwitchTo(cxt);
+    struct RelationProfile copy;
+
+    copy.num_columns                    = profile->num_columns;
+    copy.column_names                   = (char **)palloc(Max(copy.num_columns, 1) * sizeof(char *));
+    copy.states                         = (struct ColumnState *)palloc(Max(copy.num_columns, 1) * sizeof(struct ColumnState));
+    for (int i = 0; i < copy.num_columns; i++) {
+        copy.column_names[i]            = pstrdup(profile->column_names[i]);
+        copy.states[i]                  = profile->states[i];
+        if (profile->states[i].values != NULL) {
+            copy.states[i].values       = (double *)MemoryContextAllocHuge(cxt, Max(profile->states[i].num_rows, 1) * sizeof(double));
+            copy.states[i].values_capacity = profile->states[i].num_rows;
+            copy.states[i].values_cxt   = cxt;
+            memcpy(copy.states[i].values, profile->states[i].values, profile->states[i].num_rows * sizeof(double));
+        }
+    }
+    char *signature_copy                = pstrdup(column_signature);
+    MemoryContextSwitchTo(old_cxt);
+
+    /* numeric columns keep every value, so a large leaf may not fit at all */
+    int64 bytes                         = (int64) MemoryContextMemAllocated(cxt, true);
+    if (leaf_profile_cache_bytes + bytes > (int64) partition_profile_cache_limit * 1024) {
+        MemoryContextDelete(cxt);
+        return;
+    }
+
+    bool found;
+    struct LeafProfileCacheEntry *entry = hash_search(leaf_profile_cache, &relid, HASH_ENTER, &found);
+    if (found) {
+        leaf_profile_cache_bytes        -= entry->bytes;
+        MemoryContextDelete(entry->cxt);
+    }
+    entry->relfilenode                  = relfilenode;
+    entry->mod_count                    = mod_count;
+    entry->rel_size                     = rel_size;
+    entry->column_signature             = signature_copy;
+    entry->toast_aware                  = toast_aware_stats;
+    entry->toast_prefix                 = toast_prefix_bytes;
+    entry->profile                      = copy;
+    entry->cxt                          = cxt;
+    entry->bytes                        = bytes;
+    entry->generation                   = leaf_profile_cache_generation;
+    leaf_profile_cache_bytes            += bytes;
+}
+
+static void freeProfileValues(struct RelationProfile *profile) {
+    for (int i = 0; i < profile->num_columns; i++) {
+        if (profile->states[i].values != NULL) {
+            pfree(profile->states[i].values);
+            profile->states[i].values   = NULL;
+        }
+    }
+}
+
+
 void executeQueries(char * query_table_name) {
 
     if (SPI_connect() != SPI_OK_CONNECT) {
@@ -214,7 +996,20 @@ void executeQueries(char * query_table_name) {
         return;
     }
 
-    char *table_query                       = pstrdup("SELECT tablename FROM pg_tables WHERE schemaname = 'public';");
+    /*
+     * Only plain tables and leaf partitions are scanned. A partitioned table is
+     * encoded by merging its leaves' profiles, so partitioned data is read once.
+     * Rows come grouped by partition root, the root itself first.
+     */
+    char *table_query                       = pstrdup(
+        "SELECT c.oid, c.relname, c.relkind, c.relispartition, r.relname, c.relfilenode, "
+        MOD_COUNT_SQL("c.oid") ", " COLUMN_SIGNATURE_SQL("c.oid") ", pg_relation_size(c.oid) "
+        "FROM pg_class c "
+        "JOIN pg_namespace n ON n.oid = c.relnamespace "
+        "JOIN pg_class r ON r.oid = COALESCE(pg_partition_root(c.oid), c.oid) "
+        "WHERE n.nspname = 'public' AND c.relkind IN ('r', 'p') "
+        "AND c.relname NOT IN ('encodings', 'encoding_state') "
+        "ORDER BY r.relname, c.relispartition, c.relname;");
     int ret                                 = SPI_execute(table_query, true, 0);
 
     if (ret != SPI_OK_SELECT) {
@@ -227,168 +1022,705 @@ void executeQueries(char * query_table_name) {
     TupleDesc tupdesc                       = tuptable->tupdesc;
     uint64 num_tables                       = tuptable->numvals;
 
-    size_of_num_columns_array               = num_tables;
-    num_columns_array                       = (int *)malloc(num_tables * sizeof(int));
-    
+    num_query_attrs                         = 0;
+    num_candidate_attrs                     = 0;
+    capacity                                = 0;
+
+    /* one entry per ranked table; never more than the relations listed */
+    free(num_columns_array);
+    size_of_num_columns_array               = 0;
+    num_columns_array                       = (int *)malloc(Max(num_tables, 1) * sizeof(int));
+
+    char *root_name                         = NULL;
+    struct RelationProfile root_profile     = {0};
+
+    leaf_profile_cache_generation++;
 
     for (uint64 j = 0; j < num_tables; j++) {
         HeapTuple table_tuple               = tuptable->vals[j];
+        bool isnull;
 
-        char *table_name                    = SPI_getvalue(table_tuple, tupdesc, 1);
+        char *table_name                    = SPI_getvalue(table_tuple, tupdesc, 2);
         if (!table_name) continue;
 
+        Oid relid                           = DatumGetObjectId(SPI_getbinval(table_tuple, tupdesc, 1, &isnull));
+        char relkind                        = DatumGetChar(SPI_getbinval(table_tuple, tupdesc, 3, &isnull));
+        bool is_partition                   = DatumGetBool(SPI_getbinval(table_tuple, tupdesc, 4, &isnull));
+        char *table_root                    = SPI_getvalue(table_tuple, tupdesc, 5);
+        Oid relfilenode                     = DatumGetObjectId(SPI_getbinval(table_tuple, tupdesc, 6, &isnull));
+        int64 mod_count                     = DatumGetInt64(SPI_getbinval(table_tuple, tupdesc, 7, &isnull));
+        char *column_signature              = SPI_getvalue(table_tuple, tupdesc, 8);
+        int64 rel_size                      = DatumGetInt64(SPI_getbinval(table_tuple, tupdesc, 9, &isnull));
+        if (!column_signature) column_signature = "";
+
         // elog(INFO, "Table: %s", table_name);
 
-        char data_query[1024];
-        snprintf(data_query, sizeof(data_query), "SELECT * FROM %s;", table_name);
+        /* done with the previous partition tree */
+        if (root_name != NULL && strcmp(root_name, table_root) != 0) {
+            emitRootEncodings(root_name, query_table_name, &root_profile);
+            freeProfileValues(&root_profile);
+            root_name = NULL;
+        }
+
+        if (relkind == RELKIND_PARTITIONED_TABLE) {
+            /* intermediate partitioned tables are folded into the top-most root */
+            if (!is_partition && profileRelation(relid, false, &root_profile)) {
+                root_name = table_name;
+            }
+            continue;
+        }
+
+        struct RelationProfile leaf_profile;
+        struct RelationProfile *profile     = NULL;
+
+        if (is_partition) {
+            profile = lookupLeafProfile(relid, relfilenode, mod_count, rel_size, column_signature);
+        }
+        if (profile == NULL) {
+            if (!profileRelation(relid, true, &leaf_profile)) continue;
+            profile = &leaf_profile;
+            if (is_partition) {
+                storeLeafProfile(relid, relfilenode, mod_count, rel_size, column_signature, profile);
+            }
+        }
+
+        if (!is_partition || rank_leaf_partitions ||
+            (query_table_name != NULL && strcmp(table_name, query_table_name) == 0)) {
+            emitEncodings(table_name, query_table_name, profile);
+        }
+
+        if (is_partition && root_name != NULL) {
+            mergeRelationProfile(&root_profile, profile);
+        }
+
+        /* the encodings keep the column names, only the raw values can go */
+        if (profile == &leaf_profile) {
+            freeProfileValues(&leaf_profile);
+        }
+    }
+
+    if (root_name != NULL) {
+        emitRootEncodings(root_name, query_table_name, &root_profile);
+        freeProfileValues(&root_profile);
+    }
+
+    /* every public table was just listed, so cached leaves that weren't are gone */
+    evictLeafProfiles(!cache_partition_profiles);
+
+    for (size_t i = 0; i < size_of_num_columns_array; i ++)
+    {
+        if (i != 0)
+        {
+            num_columns_array[i] = num_columns_array[i - 1] + num_columns_array[i]; 
+        }
+        
+    }
+    
+
+    // elog(INFO, "ENCODINGS FOR QUERY TABLE"); // UNCOMMENT
+    // for (size_t i = 0; i < num_query_attrs; i++) {
+    //     elog(INFO, "Encoding %zu: table_name=%s, column_name=%s, data_type=%s, vector=[%.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f]",
+    //            i, query_encodings_array[i].table_name, query_encodings_array[i].column_name, query_encodings_array[i].data_type,
+    //            query_encodings_array[i].vector[0], query_encodings_array[i].vector[1], query_encodings_array[i].vector[2], query_encodings_array[i].vector[3],
+    //            query_encodings_array[i].vector[4], query_encodings_array[i].vector[5], query_encodings_array[i].vector[6], query_encodings_array[i].vector[7],
+    //            query_encodings_array[i].vector[8], query_encodings_array[i].vector[9]);
+    // }
+
+    // elog(INFO, "ENCODINGS FOR CANDIDATE TABLES"); // UNCOMMENT
+    // for (size_t i = 0; i < num_candidate_attrs; i++) {
+    //     elog(INFO, "Encoding %zu: table_name=%s, column_name=%s, data_type=%s, vector=[%.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f]",
+    //            i, candidate_encodings_array[i].table_name, candidate_encodings_array[i].column_name, candidate_encodings_array[i].data_type,
+    //            candidate_encodings_array[i].vector[0], candidate_encodings_array[i].vector[1], candidate_encodings_array[i].vector[2], candidate_encodings_array[i].vector[3],
+    //            candidate_encodings_array[i].vector[4], candidate_encodings_array[i].vector[5], candidate_encodings_array[i].vector[6], candidate_encodings_array[i].vector[7],
+    //            candidate_encodings_array[i].vector[8], candidate_encodings_array[i].vector[9]);
+    // }
+
+    SPI_finish();  
+    pfree(table_query);  
+}
+
+
+/* encode only the query table, for searches that rank tables elsewhere */
+void encodeQueryTable(char * query_table_name) {
+
+    struct RelationProfile profile;
+
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        elog(ERROR, "Could not connect to SPI");
+        return;
+    }
+
+    /* the query table is looked up where executeQueries would find it */
+    Oid lookup_types[1]                 = { TEXTOID };
+    Datum lookup_values[1]              = { CStringGetTextDatum(query_table_name) };
+    int ret                             = SPI_execute_with_args(
+        "SELECT c.oid FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+        "WHERE n.nspname = 'public' AND c.relname = $1 AND c.relkind IN ('r', 'p');",
+        1, lookup_types, lookup_values, NULL, true, 1);
+    if (ret != SPI_OK_SELECT || SPI_processed == 0) {
+        elog(ERROR, "Could not find query table %s", query_table_name);
+    }
+    bool isnull;
+    Oid query_relid                     = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+
+    if (!profileRelation(query_relid, true, &profile)) {
+        elog(ERROR, "Could not fetch data from query table %s", query_table_name);
+    }
+
+    query_encodings_array = realloc(query_encodings_array, sizeof(struct Encoding) * Max(profile.num_columns, 1));
+    if (query_encodings_array == NULL) {
+        elog(ERROR, "Memory allocation failed");
+        exit(1);
+    }
+    num_query_attrs = (size_t) profile.num_columns;
+
+    char *table_name = spiUpperStrdup(query_table_name);
+    for (int i = 0; i < profile.num_columns; i++) {
+        query_encodings_array[i] = processColumn(&profile.states[i], spiUpperStrdup(profile.column_names[i]), table_name);
+    }
+
+    SPI_finish();
+}
+
+
+PG_MODULE_MAGIC;
+
+void
+_PG_init(void)
+{
+    DefineCustomBoolVariable("unionable.toast_aware_stats",
+                             "Take string lengths from TOAST metadata instead of detoasting wide values.",
+                             "Character class ratios of compressed or out-of-line values are then estimated from a prefix of unionable.toast_prefix_bytes bytes.",
+                             &toast_aware_stats,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("unionable.toast_prefix_bytes",
+                            "Bytes of a TOASTed value sampled for character class ratios.",
+                            NULL,
+                            &toast_prefix_bytes,
+                            1024,
+                            16,
+                            1024 * 1024,
+                            PGC_USERSET,
+                            GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("unionable.rank_leaf_partitions",
+                             "Rank leaf partitions as candidates of their own.",
+                             "When off, only the partitioned table is ranked, encoded from its merged leaves.",
+                             &rank_leaf_partitions,
+                             true,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("unionable.cache_partition_profiles",
+                             "Keep leaf partition profiles for the session and re-profile only changed leaves.",
+                             "A leaf counts as changed when its relfilenode, size, column list or statistics tuple counters move. "
+                             "Counters lag other sessions' commits and stay at 0 with track_counts off, so in-place updates "
+                             "can be missed until the leaf grows or is rewritten.",
+                             &cache_partition_profiles,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("unionable.partition_profile_cache_limit",
+                            "Maximum memory the session's leaf partition profile cache may hold.",
+                            "Numeric and temporal columns keep one value per row; leaves that don't fit are not cached.",
+                            &partition_profile_cache_limit,
+                            64 * 1024,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("unionable.quantized_search",
+                             "Prune candidate tables with int8-quantized score bounds before exact scoring.",
+                             "Tables are scored exactly in descending bound order until no remaining bound can reach the top k; "
+                             "the rest are not ranked, and the top k is the same as with exact scoring.",
+                             &quantized_search,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("unionable.refresh_threshold",
+                            "Minimum number of changed tuples before refresh_encodings() re-encodes a table.",
+                            NULL,
+                            &refresh_threshold,
+                            50,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomRealVariable("unionable.refresh_scale_factor",
+                             "Fraction of a table's size to add to unionable.refresh_threshold.",
+                             NULL,
+                             &refresh_scale_factor,
+                             0.1,
+                             0.0,
+                             100.0,
+                             PGC_SIGHUP,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("unionable.refresh_io_budget",
+                            "Maximum table size refresh_encodings() reads per run (0 = unlimited).",
+                            NULL,
+                            &refresh_io_budget,
+                            1024 * 1024,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("unionable.refresh_interval",
+                            "Seconds between refresh_encodings() runs of the background worker (0 = paused).",
+                            "The worker only exists when unionable is in shared_preload_libraries.",
+                            &refresh_interval,
+                            0,
+                            0,
+                            INT_MAX / 1000,
+                            PGC_SIGHUP,
+                            GUC_UNIT_S,
+                            NULL, NULL, NULL);
+
+    DefineCustomStringVariable("unionable.refresh_database",
+                               "Database the refresh background worker connects to.",
+                               NULL,
+                               &refresh_database,
+                               "postgres",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("unionable");
+#else
+    EmitWarningsOnPlaceholders("unionable");
+#endif
+
+    if (process_shared_preload_libraries_in_progress)
+    {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags            = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time       = BgWorkerStart_RecoveryFinished;
+        worker.bgw_restart_time     = 60;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "unionable");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "unionable_refresh_worker_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "unionable encoding refresh");
+        snprintf(worker.bgw_type, BGW_MAXLEN, "unionable encoding refresh");
+        RegisterBackgroundWorker(&worker);
+    }
+}
+
+PG_FUNCTION_INFO_V1(unionableFindTopK);
+Datum
+unionableFindTopK(PG_FUNCTION_ARGS)
+{
+    char *query_table_name                          = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int top_k                                       = PG_GETARG_INT32(1);
+
+    if (top_k == 0)
+    {
+        PG_RETURN_TEXT_P(cstring_to_text("NOTHING TO RETURN!!!"));
+    }
+
+    // testFunction();
+
+    executeQueries(query_table_name);
+
+    pfree(query_table_name);
+
+    calculateSimilarities(top_k);
+
+    qsort(table_ranks, size_of_num_columns_array, sizeof(struct TableRanks), compareMatchScore);
+
+    StringInfoData result;
+    initStringInfo(&result);
+
+    elog(INFO, "_____________RANKED TABLES__________________");
+    for (size_t k = 0; k < size_of_num_columns_array; k++)
+    {
+        elog(INFO, "( %s, %f )", table_ranks[k].table_name, table_ranks[k].match_score);
+    }
+
+    for (size_t i = 0; i < top_k && i < size_of_num_columns_array - 1; i++) {
+        if (i > 0) {
+            appendStringInfo(&result, "\n "); 
+        }
+        appendStringInfo(&result, "%s", table_ranks[i].table_name); 
+    }
+
+    PG_RETURN_TEXT_P(cstring_to_text(result.data));
+}
+
+
+/* identifies this database across clusters: system identifier and database OID */
+static char *localSearchOrigin(void) {
+    return psprintf(UINT64_FORMAT "/%u", GetSystemIdentifier(), MyDatabaseId);
+}
+
+/*
+ * Shard side of a federated search: rank this database's tables against a
+ * query encoding shipped by the coordinator, returning (table_name, match_score).
+ * query_table and query_origin name the query table, which is skipped when this
+ * is the database it came from.
+ */
+PG_FUNCTION_INFO_V1(unionableFindTopKByEncoding);
+Datum
+unionableFindTopKByEncoding(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo                           = (ReturnSetInfo *) fcinfo->resultinfo;
+    int top_k                                       = PG_GETARG_INT32(3);
+    char *query_table_name                          = text_to_cstring(PG_GETARG_TEXT_PP(4));
+    char *query_origin                              = text_to_cstring(PG_GETARG_TEXT_PP(5));
+    Datum *name_datums, *type_datums, *vector_datums;
+    bool *name_nulls, *type_nulls, *vector_nulls;
+    int num_names, num_types, num_vector_values;
+    TupleDesc tupdesc;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize)) {
+        elog(ERROR, "unionableFindTopKByEncoding must be called in a context that accepts a set");
+    }
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "return type must be a row type");
+    }
+
+    deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), TEXTOID, -1, false, 'i', &name_datums, &name_nulls, &num_names);
+    deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), TEXTOID, -1, false, 'i', &type_datums, &type_nulls, &num_types);
+    deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd', &vector_datums, &vector_nulls, &num_vector_values);
+
+    if (num_names != num_types || num_vector_values != 9 * num_names) {
+        elog(ERROR, "Query encoding needs one data type and 9 vector values per column");
+    }
+
+    MemoryContext old_cxt                           = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    Tuplestorestate *tupstore                       = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode                              = SFRM_Materialize;
+    rsinfo->setResult                               = tupstore;
+    rsinfo->setDesc                                 = CreateTupleDescCopy(tupdesc);
+    MemoryContextSwitchTo(old_cxt);
+
+    /* in the query table's own database it takes the query slot, as in unionableFindTopK */
+    executeQueries(strcmp(query_origin, localSearchOrigin()) == 0 ? query_table_name : NULL);
+
+    query_encodings_array = realloc(query_encodings_array, sizeof(struct Encoding) * Max(num_names, 1));
+    if (query_encodings_array == NULL) {
+        elog(ERROR, "Memory allocation failed");
+        exit(1);
+    }
+    num_query_attrs = (size_t) num_names;
+
+    for (int i = 0; i < num_names; i++) {
+        if (name_nulls[i] || type_nulls[i]) {
+            elog(ERROR, "Query encoding must not contain NULLs");
+        }
+        query_encodings_array[i].table_name         = "query";
+        query_encodings_array[i].column_name        = TextDatumGetCString(name_datums[i]);
+        query_encodings_array[i].data_type          = TextDatumGetCString(type_datums[i]);
+        for (int d = 0; d < 9; d++) {
+            query_encodings_array[i].vector[d]      = vector_nulls[9 * i + d] ? 0.0 : DatumGetFloat8(vector_datums[9 * i + d]);
+        }
+    }
+
+    calculateSimilarities(top_k);
+
+    qsort(table_ranks, size_of_num_columns_array, sizeof(struct TableRanks), compareMatchScore);
+
+    for (size_t i = 0; i < top_k && i < size_of_num_columns_array; i++) {
+        Datum values[2];
+        bool nulls[2]                               = {false, false};
 
-        int ret_data                        = SPI_execute(data_query, true, 0);
-        if (ret_data != SPI_OK_SELECT) {
-            elog(WARNING, "Could not fetch data from table %s", table_name);
-            continue;
-        }
+        if (table_ranks[i].table_name == NULL || table_ranks[i].match_score == -INFINITY) break;
 
-        SPITupleTable *data_tuptable        = SPI_tuptable;
-        TupleDesc data_tupdesc              = data_tuptable->tupdesc;
+        values[0]                                   = CStringGetTextDatum(table_ranks[i].table_name);
+        values[1]                                   = Float8GetDatum(table_ranks[i].match_score);
+        tuplestore_putvalues(tupstore, rsinfo->setDesc, values, nulls);
+    }
 
-        int num_columns                     = data_tupdesc->natts;
-        uint64 num_rows                     = data_tuptable->numvals;
-        char buf[8192];
-        // char * data_type;
-        HeapTuple row;
-        char **column_values;
-        char column_names[8192];
-        column_names[0]                     = '\0';
-        
+    return (Datum) 0;
+}
 
-        if (strcmp(table_name, query_table_name) == 0)
-        {
-            query_encodings_array = realloc(query_encodings_array, sizeof(struct Encoding) * num_columns);
-            if (query_encodings_array == NULL) {
-                elog(ERROR, "Memory allocation failed");
-                free(query_encodings_array);
-                exit(1);
-            }
-            num_query_attrs = (size_t) num_columns;
-            num_columns_array[j]            = 0;
-        }
-        else
-        {
-            num_columns_array[j]            = num_columns;
-        }
-
-        for (int i = 1; i <= num_columns; i++) {
-            snprintf(column_names + strlen(column_names), sizeof(column_names) - strlen(column_names), " %s%s",
-                     SPI_fname(data_tupdesc, i),
-                     (i == num_columns) ? " " : " |");
-            
-            buf[0]                          = '\0';  // Reset buffer for each row
-            // elog(INFO, "Column: %s", SPI_fname(data_tupdesc, i));
-            column_values                   = (char **)palloc(num_rows * sizeof(char *));
-
-            for (uint64 k = 0; k < num_rows; k++) {
-                row                         = data_tuptable->vals[k];
-                char *value                 = SPI_getvalue(row, data_tupdesc, i);
-                snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), " %s%s", value, (i == num_columns) ? " " : " |");
-                if (value == NULL)
-                {
-                    column_values[k]        = pstrdup("NULL");
-                }
-                else
-                {
-                    column_values[k]        = pstrdup(value);
-                }
-            }
-            // elog(INFO, "Data: %s", buf);
-            
-            struct Encoding column          = processColumn(column_values, SPI_gettype(data_tupdesc, i), num_rows, SPI_fname(data_tupdesc, i), table_name);
-            
-            if (strcmp(table_name, query_table_name) == 0){
-                query_encodings_array[i-1]  = column;
-            }
-            else
-            {
-                addEncoding(column);
-            }
-        }
 
-        // elog(INFO, "Columns: %s", column_names);
-        
-        pfree(column_values);
-        SPI_freetuptable(data_tuptable);  
-    }
+/* one remote database in a federated search */
+struct FederatedShard {
+    char *conninfo;
+    PGconn *conn;
+    PostgresPollingStatusType poll_status;
+    bool connecting;
+    bool done;
+};
 
-    for (size_t i = 0; i < num_tables; i ++)
-    {
-        if (i != 0)
-        {
-            num_columns_array[i] = num_columns_array[i - 1] + num_columns_array[i]; 
+static void appendTextArrayLiteral(StringInfo buf, char **elements, int count) {
+    appendStringInfoChar(buf, '{');
+    for (int i = 0; i < count; i++) {
+        if (i > 0) appendStringInfoChar(buf, ',');
+        appendStringInfoChar(buf, '"');
+        for (const char *c = elements[i]; *c; c++) {
+            if (*c == '"' || *c == '\\') appendStringInfoChar(buf, '\\');
+            appendStringInfoChar(buf, *c);
         }
-        
+        appendStringInfoChar(buf, '"');
     }
-    
+    appendStringInfoChar(buf, '}');
+}
 
-    // elog(INFO, "ENCODINGS FOR QUERY TABLE"); // UNCOMMENT
-    // for (size_t i = 0; i < num_query_attrs; i++) {
-    //     elog(INFO, "Encoding %zu: table_name=%s, column_name=%s, data_type=%s, vector=[%.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f]",
-    //            i, query_encodings_array[i].table_name, query_encodings_array[i].column_name, query_encodings_array[i].data_type,
-    //            query_encodings_array[i].vector[0], query_encodings_array[i].vector[1], query_encodings_array[i].vector[2], query_encodings_array[i].vector[3],
-    //            query_encodings_array[i].vector[4], query_encodings_array[i].vector[5], query_encodings_array[i].vector[6], query_encodings_array[i].vector[7],
-    //            query_encodings_array[i].vector[8], query_encodings_array[i].vector[9]);
-    // }
+/* shards are named by host, port and database, never by conninfo, which may hold a password */
+static void failShard(struct FederatedShard *shard, const char *what) {
+    elog(WARNING, "Federated search: %s failed for shard %s:%s/%s: %s", what,
+         PQhost(shard->conn), PQport(shard->conn), PQdb(shard->conn), PQerrorMessage(shard->conn));
+    shard->done = true;
+}
 
-    // elog(INFO, "ENCODINGS FOR CANDIDATE TABLES"); // UNCOMMENT
-    // for (size_t i = 0; i < num_candidate_attrs; i++) {
-    //     elog(INFO, "Encoding %zu: table_name=%s, column_name=%s, data_type=%s, vector=[%.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f, %.2f]",
-    //            i, candidate_encodings_array[i].table_name, candidate_encodings_array[i].column_name, candidate_encodings_array[i].data_type,
-    //            candidate_encodings_array[i].vector[0], candidate_encodings_array[i].vector[1], candidate_encodings_array[i].vector[2], candidate_encodings_array[i].vector[3],
-    //            candidate_encodings_array[i].vector[4], candidate_encodings_array[i].vector[5], candidate_encodings_array[i].vector[6], candidate_encodings_array[i].vector[7],
-    //            candidate_encodings_array[i].vector[8], candidate_encodings_array[i].vector[9]);
-    // }
+/*
+ * Shards are reached from the server's OS account, whose ~/.pgpass and the
+ * shards' peer/trust rules could log a caller in as someone else. As dblink
+ * does, non-superusers must put a password in the conninfo, and the shard must
+ * then actually have used it (checked once connected).
+ */
+static void checkShardConninfo(const char *conninfo, int shard_number) {
+    char *parse_error                               = NULL;
+    PQconninfoOption *options                       = PQconninfoParse(conninfo, &parse_error);
+    bool has_password                               = false;
+
+    if (options == NULL) {
+        char *message = parse_error ? pstrdup(parse_error) : "out of memory";
+        if (parse_error) PQfreemem(parse_error);
+        elog(ERROR, "Federated search: invalid connection string for shard %d: %s", shard_number, message);
+    }
+    for (PQconninfoOption *option = options; option->keyword != NULL; option++) {
+        if (strcmp(option->keyword, "password") == 0 && option->val != NULL && option->val[0] != '\0') {
+            has_password = true;
+        }
+    }
+    PQconninfoFree(options);
 
-    SPI_finish();  
-    pfree(table_query);  
+    if (!has_password) {
+        elog(ERROR, "Federated search: non-superusers must give a password in the connection string of shard %d", shard_number);
+    }
 }
 
+/* collect (shard.table_name, match_score) rows of a finished shard query */
+static void collectShardResult(struct FederatedShard *shard, PGresult *res, struct TableRanks **matches, size_t *num_matches) {
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        elog(WARNING, "Federated search: query failed for shard %s:%s/%s: %s",
+             PQhost(shard->conn), PQport(shard->conn), PQdb(shard->conn), PQresultErrorMessage(res));
+        return;
+    }
 
-PG_MODULE_MAGIC;
+    int num_rows = PQntuples(res);
+    *matches = (struct TableRanks *)repalloc(*matches, (*num_matches + num_rows + 1) * sizeof(struct TableRanks));
+    for (int r = 0; r < num_rows; r++) {
+        (*matches)[*num_matches].table_name  = psprintf("%s:%s/%s.%s", PQhost(shard->conn), PQport(shard->conn),
+                                                        PQdb(shard->conn), PQgetvalue(res, r, 0));
+        (*matches)[*num_matches].match_score = strtod(PQgetvalue(res, r, 1), NULL);
+        (*num_matches)++;
+    }
+}
 
-PG_FUNCTION_INFO_V1(unionableFindTopK);
+/*
+ * Federated top-k: encode the query table locally, send the encoding to every
+ * shard at once and merge the per-shard top-k lists. Connections and queries
+ * are all non-blocking, so latency is that of the slowest shard.
+ */
+PG_FUNCTION_INFO_V1(unionableFindTopKFederated);
 Datum
-unionableFindTopK(PG_FUNCTION_ARGS)
+unionableFindTopKFederated(PG_FUNCTION_ARGS)
 {
     char *query_table_name                          = text_to_cstring(PG_GETARG_TEXT_PP(0));
     int top_k                                       = PG_GETARG_INT32(1);
+    Datum *conninfo_datums;
+    bool *conninfo_nulls;
+    int num_shards;
 
     if (top_k == 0)
     {
         PG_RETURN_TEXT_P(cstring_to_text("NOTHING TO RETURN!!!"));
     }
 
-    // testFunction();
+    deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), TEXTOID, -1, false, 'i', &conninfo_datums, &conninfo_nulls, &num_shards);
 
-    executeQueries(query_table_name);
+    bool is_superuser                               = superuser();
+    if (!is_superuser) {
+        for (int s = 0; s < num_shards; s++) {
+            if (!conninfo_nulls[s]) checkShardConninfo(TextDatumGetCString(conninfo_datums[s]), s + 1);
+        }
+    }
 
-    pfree(query_table_name);
+    encodeQueryTable(query_table_name);
 
-    calculateSimilarities();
+    /* the query encoding as text[] / text[] / float8[] parameters */
+    char **column_names                             = (char **)palloc(Max(num_query_attrs, 1) * sizeof(char *));
+    char **data_types                               = (char **)palloc(Max(num_query_attrs, 1) * sizeof(char *));
+    StringInfoData names_param, types_param, vectors_param;
+    char top_k_param[16];
 
-    qsort(table_ranks, size_of_num_columns_array, sizeof(struct TableRanks), compareMatchScore);
+    initStringInfo(&names_param);
+    initStringInfo(&types_param);
+    initStringInfo(&vectors_param);
+    appendStringInfoChar(&vectors_param, '{');
+    for (size_t i = 0; i < num_query_attrs; i++) {
+        column_names[i]                             = query_encodings_array[i].column_name;
+        data_types[i]                               = query_encodings_array[i].data_type;
+        for (int d = 0; d < 9; d++) {
+            appendStringInfo(&vectors_param, "%s%.17g", (i == 0 && d == 0) ? "" : ",", query_encodings_array[i].vector[d]);
+        }
+    }
+    appendStringInfoChar(&vectors_param, '}');
+    appendTextArrayLiteral(&names_param, column_names, num_query_attrs);
+    appendTextArrayLiteral(&types_param, data_types, num_query_attrs);
+    snprintf(top_k_param, sizeof(top_k_param), "%d", top_k);
+
+    free(query_encodings_array);
+    query_encodings_array = NULL;
+
+    /* the shard holding the query table (possibly this one) must not rank it against itself */
+    char *origin_param                              = localSearchOrigin();
+    const char *shard_query                         = "SELECT table_name, match_score FROM unionableFindTopKByEncoding($1::text[], $2::text[], $3::float8[], $4::integer, $5::text, $6::text);";
+    const char *param_values[6]                     = { names_param.data, types_param.data, vectors_param.data, top_k_param,
+                                                        query_table_name, origin_param };
+
+    struct FederatedShard *shards                   = (struct FederatedShard *)palloc0(Max(num_shards, 1) * sizeof(struct FederatedShard));
+    struct TableRanks *matches                      = (struct TableRanks *)palloc(sizeof(struct TableRanks));
+    size_t num_matches                              = 0;
+    WaitEventSet *volatile wait_set                 = NULL;
+
+    PG_TRY();
+    {
+        for (int s = 0; s < num_shards; s++) {
+            struct FederatedShard *shard            = &shards[s];
+            if (conninfo_nulls[s]) {
+                shard->done = true;
+                continue;
+            }
+            shard->conninfo                         = TextDatumGetCString(conninfo_datums[s]);
+            shard->conn                             = PQconnectStart(shard->conninfo);
+            shard->connecting                       = true;
+            shard->poll_status                      = PGRES_POLLING_WRITING;
+            if (shard->conn == NULL) {
+                elog(WARNING, "Federated search: out of memory connecting to shard %d", s + 1);
+                shard->done = true;
+            } else if (PQstatus(shard->conn) == CONNECTION_BAD) {
+                failShard(shard, "connection");
+            }
+        }
+
+        for (;;) {
+            int pending = 0;
+            for (int s = 0; s < num_shards; s++) {
+                pending += !shards[s].done;
+            }
+            if (pending == 0) break;
+
+            CHECK_FOR_INTERRUPTS();
+
+#if PG_VERSION_NUM >= 170000
+            wait_set                                = CreateWaitEventSet(CurrentResourceOwner, pending + 2);
+#else
+            wait_set                                = CreateWaitEventSet(CurrentMemoryContext, pending + 2);
+#endif
+            WaitEvent *occurred                     = (WaitEvent *)palloc((pending + 2) * sizeof(WaitEvent));
+
+            AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+            AddWaitEventToSet(wait_set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+            for (int s = 0; s < num_shards; s++) {
+                struct FederatedShard *shard        = &shards[s];
+                uint32 events;
+                if (shard->done) continue;
+                if (shard->connecting) {
+                    events = shard->poll_status == PGRES_POLLING_READING ? WL_SOCKET_READABLE : WL_SOCKET_WRITEABLE;
+                } else {
+                    events = WL_SOCKET_READABLE | (PQflush(shard->conn) == 1 ? WL_SOCKET_WRITEABLE : 0);
+                }
+                AddWaitEventToSet(wait_set, events, PQsocket(shard->conn), NULL, shard);
+            }
+
+            int num_events = WaitEventSetWait(wait_set, -1, occurred, pending + 2, PG_WAIT_EXTENSION);
+
+            for (int e = 0; e < num_events; e++) {
+                struct FederatedShard *shard        = (struct FederatedShard *) occurred[e].user_data;
+
+                if (occurred[e].events & WL_LATCH_SET) {
+                    ResetLatch(MyLatch);
+                    continue;
+                }
+
+                if (shard->connecting) {
+                    shard->poll_status = PQconnectPoll(shard->conn);
+                    if (shard->poll_status == PGRES_POLLING_FAILED) {
+                        failShard(shard, "connection");
+                    } else if (shard->poll_status == PGRES_POLLING_OK) {
+                        shard->connecting = false;
+                        if (!is_superuser && !PQconnectionUsedPassword(shard->conn)) {
+                            elog(ERROR, "Federated search: shard %s:%s/%s did not ask for a password; non-superusers may only use password-authenticated shards",
+                                 PQhost(shard->conn), PQport(shard->conn), PQdb(shard->conn));
+                        }
+                        if (PQsetnonblocking(shard->conn, 1) != 0 ||
+                            !PQsendQueryParams(shard->conn, shard_query, 6, NULL, param_values, NULL, NULL, 0)) {
+                            failShard(shard, "sending the query");
+                        }
+                    }
+                    continue;
+                }
+
+                if (PQflush(shard->conn) == -1 || !PQconsumeInput(shard->conn)) {
+                    failShard(shard, "reading the result");
+                    continue;
+                }
+                while (!shard->done && !PQisBusy(shard->conn)) {
+                    PGresult *res = PQgetResult(shard->conn);
+                    if (res == NULL) {
+                        shard->done = true;
+                        break;
+                    }
+                    collectShardResult(shard, res, &matches, &num_matches);
+                    PQclear(res);
+                }
+            }
+
+            FreeWaitEventSet(wait_set);
+            wait_set = NULL;
+            pfree(occurred);
+        }
+    }
+    PG_FINALLY();
+    {
+        /* an ERROR mid-iteration would otherwise leak the set (and its epoll fd) */
+        if (wait_set != NULL) FreeWaitEventSet(wait_set);
+        for (int s = 0; s < num_shards; s++) {
+            if (shards[s].conn != NULL) PQfinish(shards[s].conn);
+        }
+    }
+    PG_END_TRY();
+
+    /* every shard already returned its own top-k, so the global top-k is among them */
+    qsort(matches, num_matches, sizeof(struct TableRanks), compareMatchScore);
 
     StringInfoData result;
     initStringInfo(&result);
 
     elog(INFO, "_____________RANKED TABLES__________________");
-    for (size_t k = 0; k < size_of_num_columns_array; k++)
+    for (size_t k = 0; k < num_matches; k++)
     {
-        elog(INFO, "( %s, %f )", table_ranks[k].table_name, table_ranks[k].match_score);
+        elog(INFO, "( %s, %f )", matches[k].table_name, matches[k].match_score);
     }
 
-    for (size_t i = 0; i < top_k && i < size_of_num_columns_array - 1; i++) {
+    for (size_t i = 0; i < top_k && i < num_matches; i++) {
         if (i > 0) {
             appendStringInfo(&result, "\n "); 
         }
-        appendStringInfo(&result, "%s", table_ranks[i].table_name); 
+        appendStringInfo(&result, "%s", matches[i].table_name); 
     }
 
     PG_RETURN_TEXT_P(cstring_to_text(result.data));
@@ -399,7 +1731,7 @@ PG_FUNCTION_INFO_V1(create_encoding);
 Datum
 create_encoding(PG_FUNCTION_ARGS)
 {
-    char *table_create_query                        = pstrdup("CREATE TABLE if not exists encodings (tbl_name VARCHAR, column_name VARCHAR, vector DOUBLE PRECISION[]);");
+    char *table_create_query                        = pstrdup(ENCODINGS_TABLE_DDL);
     
     if (SPI_connect() != SPI_OK_CONNECT) {
         elog(ERROR, "Could not connect to SPI");
@@ -421,6 +1753,198 @@ create_encoding(PG_FUNCTION_ARGS)
 }
 
 
+/* replace the stored encodings and change-detection state of one table */
+static void storeTableEncodings(char *table_name, Oid relfilenode, int64 mod_count, char *column_signature,
+                                struct RelationProfile *profile)
+{
+    Oid delete_types[1]                             = { TEXTOID };
+    Datum delete_values[1]                          = { CStringGetTextDatum(table_name) };
+    Oid insert_types[4]                             = { TEXTOID, TEXTOID, TEXTOID, FLOAT8ARRAYOID };
+    Oid state_types[4]                              = { TEXTOID, OIDOID, INT8OID, TEXTOID };
+    Datum state_values[4]                           = { CStringGetTextDatum(table_name), ObjectIdGetDatum(relfilenode),
+                                                        Int64GetDatum(mod_count), CStringGetTextDatum(column_signature) };
+
+    SPI_execute_with_args("DELETE FROM public.encodings WHERE tbl_name = $1;", 1, delete_types, delete_values, NULL, false, 0);
+
+    /* an empty table has nothing to encode, but its state is still recorded */
+    for (int i = 0; i < profile->num_columns && profile->states[i].num_rows > 0; i++) {
+        struct Encoding column                      = processColumn(&profile->states[i], profile->column_names[i], table_name);
+        Datum vector_datums[9];
+        for (int d = 0; d < 9; d++) {
+            vector_datums[d]                        = Float8GetDatum(column.vector[d]);
+        }
+        Datum insert_values[4]                      = { CStringGetTextDatum(table_name), CStringGetTextDatum(column.column_name),
+                                                        CStringGetTextDatum(column.data_type),
+                                                        PointerGetDatum(construct_array(vector_datums, 9, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd')) };
+        SPI_execute_with_args("INSERT INTO public.encodings (tbl_name, column_name, data_type, vector) VALUES ($1, $2, $3, $4);",
+                              4, insert_types, insert_values, NULL, false, 0);
+    }
+
+    SPI_execute_with_args("INSERT INTO public.encoding_state (tbl_name, relfilenode, mod_count, column_signature, refreshed_at) "
+                          "VALUES ($1, $2, $3, $4, now()) "
+                          "ON CONFLICT (tbl_name) DO UPDATE SET relfilenode = EXCLUDED.relfilenode, mod_count = EXCLUDED.mod_count, "
+                          "column_signature = EXCLUDED.column_signature, refreshed_at = EXCLUDED.refreshed_at;",
+                          4, state_types, state_values, NULL, false, 0);
+}
+
+/*
+ * Re-encode only the tables that changed since they were last encoded: new or
+ * rewritten tables and tables whose column list changed come first, then tables
+ * with more than refresh_threshold + refresh_scale_factor * reltuples changed
+ * tuples, largest change first, until refresh_io_budget is spent. The budget is
+ * charged with pg_table_size(), so TOAST read while detoasting counts too.
+ *
+ * Only plain tables and leaf partitions are stored. Nothing reads the stored
+ * encodings yet: searches still profile every table live, and partitioned
+ * tables are merged from their leaves there.
+ */
+int refreshEncodings(void) {
+
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        elog(ERROR, "Could not connect to SPI");
+        return 0;
+    }
+
+    /*
+     * One refresh at a time (worker or CALL): each replaces a table's rows in
+     * public.encodings, which has no key, so concurrent runs would duplicate
+     * them. The lock conflicts only with itself, so searches aren't blocked.
+     */
+    SPI_execute("LOCK TABLE public.encoding_state IN SHARE UPDATE EXCLUSIVE MODE;", false, 0);
+
+    /* forget tables that no longer exist */
+    SPI_execute("DELETE FROM public.encodings e WHERE NOT EXISTS (SELECT 1 FROM pg_tables t "
+                "WHERE t.schemaname = 'public' AND t.tablename = e.tbl_name);", false, 0);
+    SPI_execute("DELETE FROM public.encoding_state e WHERE NOT EXISTS (SELECT 1 FROM pg_tables t "
+                "WHERE t.schemaname = 'public' AND t.tablename = e.tbl_name);", false, 0);
+
+    int ret = SPI_execute(
+        "SELECT t.relname, t.relfilenode, t.mod_count, t.column_signature, pg_table_size(t.oid), "
+        "       s.tbl_name IS NULL OR s.relfilenode <> t.relfilenode OR s.column_signature IS DISTINCT FROM t.column_signature, "
+        "       t.mod_count - COALESCE(s.mod_count, 0), GREATEST(t.reltuples, 0)::float8, t.oid "
+        "FROM (SELECT c.oid, c.relname, c.relfilenode, c.reltuples, "
+        "             " MOD_COUNT_SQL("c.oid") " AS mod_count, "
+        "             " COLUMN_SIGNATURE_SQL("c.oid") " AS column_signature "
+        "      FROM pg_class c JOIN pg_namespace n ON n.oid = c.relnamespace "
+        "      WHERE n.nspname = 'public' AND c.relkind = 'r' "
+        "      AND c.relname NOT IN ('encodings', 'encoding_state')) t "
+        "LEFT JOIN public.encoding_state s ON s.tbl_name = t.relname "
+        "ORDER BY 6 DESC, abs(t.mod_count - COALESCE(s.mod_count, 0)) DESC;", false, 0);
+
+    if (ret != SPI_OK_SELECT) {
+        elog(ERROR, "Failed to fetch table change counters");
+        SPI_finish();
+        return 0;
+    }
+
+    SPITupleTable *tuptable                 = SPI_tuptable;
+    TupleDesc tupdesc                       = tuptable->tupdesc;
+    int64 budget_bytes                      = (int64) refresh_io_budget * 1024;
+    int64 spent_bytes                       = 0;
+    bool ran_one                            = false;
+    int num_stale                           = 0;
+    int num_refreshed                       = 0;
+
+    for (uint64 j = 0; j < tuptable->numvals; j++) {
+        HeapTuple table_tuple               = tuptable->vals[j];
+        bool isnull;
+
+        char *table_name                    = SPI_getvalue(table_tuple, tupdesc, 1);
+        Oid relfilenode                     = DatumGetObjectId(SPI_getbinval(table_tuple, tupdesc, 2, &isnull));
+        int64 mod_count                     = DatumGetInt64(SPI_getbinval(table_tuple, tupdesc, 3, &isnull));
+        char *column_signature              = SPI_getvalue(table_tuple, tupdesc, 4);
+        int64 rel_size                      = DatumGetInt64(SPI_getbinval(table_tuple, tupdesc, 5, &isnull));
+        bool altered                        = DatumGetBool(SPI_getbinval(table_tuple, tupdesc, 6, &isnull));
+        int64 changes                       = DatumGetInt64(SPI_getbinval(table_tuple, tupdesc, 7, &isnull));
+        double reltuples                    = DatumGetFloat8(SPI_getbinval(table_tuple, tupdesc, 8, &isnull));
+        Oid relid                           = DatumGetObjectId(SPI_getbinval(table_tuple, tupdesc, 9, &isnull));
+        if (!column_signature) column_signature = "";
+
+        /* counters going backwards means the statistics were reset: refresh */
+        bool stale = altered || changes < 0 || changes >= refresh_threshold + refresh_scale_factor * reltuples;
+        if (!stale) continue;
+        num_stale++;
+
+        /* the first stale table always runs, so an oversized one can't starve */
+        if (budget_bytes > 0 && ran_one && spent_bytes + rel_size > budget_bytes) continue;
+
+        struct RelationProfile profile;
+        if (!profileRelation(relid, true, &profile)) continue;
+        ran_one = true;
+
+        storeTableEncodings(table_name, relfilenode, mod_count, column_signature, &profile);
+        spent_bytes += rel_size;
+        num_refreshed++;
+    }
+
+    SPI_finish();
+
+    elog(DEBUG1, "unionable: refreshed %d of %d stale tables (%lld bytes read)", num_refreshed, num_stale, (long long) spent_bytes);
+    return num_refreshed;
+}
+
+PG_FUNCTION_INFO_V1(refresh_encodings);
+Datum
+refresh_encodings(PG_FUNCTION_ARGS)
+{
+    int num_refreshed                               = refreshEncodings();
+
+    elog(INFO, "refresh_encodings: %d table(s) re-encoded", num_refreshed);
+    PG_RETURN_VOID();
+}
+
+/* runs refreshEncodings() every unionable.refresh_interval seconds */
+void
+unionable_refresh_worker_main(Datum main_arg)
+{
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    BackgroundWorkerInitializeConnection(refresh_database, NULL, 0);
+
+    /*
+     * The worker runs as the bootstrap superuser: keep operators and functions
+     * that users can create in public out of name resolution, as the
+     * refresh_encodings() procedure does.
+     */
+    SetConfigOption("search_path", "pg_catalog, pg_temp", PGC_SUSET, PGC_S_SESSION);
+
+    for (;;)
+    {
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_EXIT_ON_PM_DEATH | (refresh_interval > 0 ? WL_TIMEOUT : 0),
+                         refresh_interval * 1000L,
+                         PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+            continue;
+        }
+
+        if (refresh_interval <= 0)
+            continue;
+
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, "refresh_encodings()");
+
+        refreshEncodings();
+
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_stat(false);
+        pgstat_report_activity(STATE_IDLE, NULL);
+    }
+}
+
+
 int compareValues(const void *a, const void *b) {
     double diff                 = *(double*)a - *(double*)b;
     return (diff > 0) - (diff < 0);
@@ -456,7 +1980,8 @@ double calculatePercentile(double *data, int size, double percentile) {
     return data[lower] * (1 - weight) + data[upper] * weight;
 }
 
-struct NumericSummaryStats calculateNumericSummaryStats(char **column_values, int num_values) {
+/* values is sorted in place */
+struct NumericSummaryStats calculateNumericSummaryStats(double *values, int num_values) {
     struct NumericSummaryStats stats;
 
     /*count*/
@@ -475,25 +2000,11 @@ struct NumericSummaryStats calculateNumericSummaryStats(char **column_values, in
         return stats;
     }
 
-    double *values = malloc(num_values * sizeof(double));
-
-    if (values == NULL) {
-        elog(INFO, "Memory allocation failed.");
-        return stats;
-    }
-
     double sum = 0.0;
     stats.min                   = INFINITY;
     stats.max                   = -INFINITY;
 
     for (int i = 0; i < num_values; i++) {
-        if (column_values[i] != NULL) {
-            values[i]           = atof(column_values[i]);
-        }
-        else 
-        {
-            values[i]           = 0.0;
-        }
         sum += values[i];
         /* Calculated min and max values */
         if (values[i] < stats.min) stats.min = values[i];
@@ -521,15 +2032,13 @@ struct NumericSummaryStats calculateNumericSummaryStats(char **column_values, in
     /* range */
     stats.range                 = stats.max - stats.min;
 
-    // Free dynamically allocated memory
-    free(values);
-
     return stats;
 }
 
 
-struct StringSummaryStats calculateStringSummaryStats(char **column_values, int num_values) {
+struct StringSummaryStats calculateStringSummaryStats(struct ColumnState *state) {
     struct StringSummaryStats stats;
+    int num_values                          = state->num_rows;
     
     stats.count                             = num_values;
     stats.mean                              = 0.0;
@@ -544,66 +2053,20 @@ struct StringSummaryStats calculateStringSummaryStats(char **column_values, int
         elog(ERROR, "No values to calculate statistics.");
         return stats;
     }
-    
-    double total_numerical_ratio            = 0.0;
-    double total_whitespace_ratio           = 0.0;
-    int total_length                        = 0;
-    double length_sum                       = 0.0;
-    double length_sum_squared               = 0.0;
-
-    stats.min                               = INFINITY;
-    stats.max                               = -INFINITY;
-
-    // Iterate through each string in the array
-    for (int i = 0; i < num_values; i++) {
-        char *str = column_values[i];
-        
-        if (str == NULL) {
-            continue; // Skip NULL strings
-        }
-
-        int num_numerical_chars = 0;
-        int num_whitespace_chars = 0;
-        int total_chars = 0;
-
-        // Count characters in the current string
-        for (int j = 0; str[j] != '\0'; j++) {
-            total_chars++;
-            if (isdigit((unsigned char)str[j])) {
-                num_numerical_chars++;
-            } else if (isspace((unsigned char)str[j])) {
-                num_whitespace_chars++;
-            }
-        }
 
-        // Update min and max lengths
-        if (total_chars < stats.min) stats.min = total_chars;
-        if (total_chars > stats.max) stats.max = total_chars;
-
-        // Accumulate length statistics
-        length_sum += total_chars;
-        length_sum_squared += total_chars * total_chars;
-
-        // Calculate ratios for this string
-        if (total_chars > 0) { // Avoid division by zero for empty strings
-            double numerical_ratio = (double)num_numerical_chars / total_chars;
-            double whitespace_ratio = (double)num_whitespace_chars / total_chars;
-
-            // Accumulate the ratios
-            total_numerical_ratio += numerical_ratio;
-            total_whitespace_ratio += whitespace_ratio;
-        }
-    }
+    // Lengths are only tracked for non-NULL values
+    stats.min = (state->num_nulls < num_values) ? state->min_length : 0;
+    stats.max = state->max_length;
 
     // Calculate average ratios
-    stats.average_numerical_chars_ratio = total_numerical_ratio / num_values;
-    stats.average_whitespace_ratio = total_whitespace_ratio / num_values;
+    stats.average_numerical_chars_ratio = state->total_numerical_ratio / num_values;
+    stats.average_whitespace_ratio = state->total_whitespace_ratio / num_values;
 
     // Calculate average length
-    stats.mean = length_sum / num_values;
+    stats.mean = state->length_sum / num_values;
 
     // Calculate variance of lengths
-    stats.stddev = (length_sum_squared / num_values) - (stats.mean * stats.mean);
+    stats.stddev = (state->length_sum_squared / num_values) - (stats.mean * stats.mean);
     stats.range  = stats.max - stats.min;
 
     return stats;
@@ -641,7 +2104,129 @@ double findGreedyMatch(struct Similarities *sorted_similarities, int size) {
     return match_score;
 }
 
-void calculateSimilarities()
+#define QUANTIZED_SCALE 127.0
+
+/*
+ * Largest difference between a quantized and an exact similarity: each code is
+ * off by at most 0.5 / 127, i.e. at most 1.5 / 127 in L2 over 9 components, so
+ * |a'.b' - a.b| <= 2 * 1.5 / 127 + 9 * (0.5 / 127)^2 for unit vectors.
+ */
+#define QUANTIZED_PAIR_SLACK (3.0 / QUANTIZED_SCALE + 2.25 / (QUANTIZED_SCALE * QUANTIZED_SCALE))
+
+static const char *const encoding_families[] = { "text", "jsonb", "numeric", "temporal", "boolean", "uuid", "unknown" };
+
+static uint8 encodingFamilyId(const char *data_type) {
+    uint8 i;
+    for (i = 0; i < lengthof(encoding_families); i++) {
+        if (strcmp(encoding_families[i], data_type) == 0) break;
+    }
+    return i;
+}
+
+/* vectors are unit length, so every component fits in [-127, 127] */
+static void quantizeEncoding(const struct Encoding *encoding, struct QuantizedVector *code) {
+    for (int d = 0; d < 9; d++) {
+        code->codes[d] = (int8) rint(encoding->vector[d] * QUANTIZED_SCALE);
+    }
+    code->family = encodingFamilyId(encoding->data_type);
+}
+
+static inline int32 quantizedDotProduct(const struct QuantizedVector *a, const struct QuantizedVector *b) {
+    int32 dot_product = 0;
+    for (int d = 0; d < 9; d++) {
+        dot_product += a->codes[d] * b->codes[d];
+    }
+    return dot_product;
+}
+
+/*
+ * Approximate upper bound on candidate table k's greedy match score, read from
+ * the int8 arena alone. Each query column is matched at most once, so it adds
+ * at most its best positive similarity to a compatible column of the table.
+ * Tables without a compatible column get -INFINITY, as scoreTable gives them.
+ */
+static double quantizedScoreBound(size_t k, const struct QuantizedVector *query_codes) {
+    size_t start_idx = (k == 0) ? 0 : num_columns_array[k - 1];
+    size_t end_idx = num_columns_array[k];
+    const struct QuantizedVector *table_codes = candidate_codes_array + start_idx;
+    size_t num_table_attrs = end_idx - start_idx;
+    int64 bound = 0;
+    bool compatible = false;
+
+    for (size_t i = 0; i < num_query_attrs; i++)
+    {
+        int32 best = 0;
+        for (size_t j = 0; j < num_table_attrs; j++)
+        {
+            if (query_codes[i].family != table_codes[j].family) continue;
+            compatible = true;
+            best = Max(best, quantizedDotProduct(&query_codes[i], &table_codes[j]));
+        }
+        bound += best;
+    }
+
+    return compatible ? bound / (QUANTIZED_SCALE * QUANTIZED_SCALE) : -INFINITY;
+}
+
+/* greedy match score of candidate table k against the query table */
+static double scoreTable(size_t k, struct ColumnNode *array_source_nodes, struct ColumnNode *array_destination_nodes,
+                         char **table_name)
+{
+    size_t start_idx = (k == 0) ? 0 : num_columns_array[k - 1];
+    size_t end_idx = num_columns_array[k];
+    struct Similarities *running_search_space = (struct Similarities *)malloc(Max(num_query_attrs * (end_idx - start_idx), 1) * sizeof(struct Similarities));
+    int counter = 0;
+    double match_score = -INFINITY;
+
+    if (!running_search_space) {
+        elog(ERROR, "Memory allocation failed for running search space\n");
+        exit(1);
+    }
+
+    for(size_t i = 0; i < num_query_attrs; i++)
+    {
+        for(size_t j = start_idx; j < end_idx; j++) 
+        {
+            if (strcmp(query_encodings_array[i].data_type, candidate_encodings_array[j].data_type) == 0)
+            {
+                running_search_space[counter].query_ColumnNode = &array_source_nodes[i];
+                running_search_space[counter].candidate_ColumnNode = &array_destination_nodes[j];
+                running_search_space[counter].similarity_score = cosineSimilarity(query_encodings_array[i].vector, candidate_encodings_array[j].vector, 9);
+                counter++;
+            }
+        }
+    }
+
+    qsort(running_search_space, counter, sizeof(struct Similarities), compareSimilarity);
+
+    *table_name = NULL;
+    if (counter > 0)
+    {
+        *table_name = running_search_space[0].candidate_ColumnNode->table_name;
+        match_score = findGreedyMatch(running_search_space, counter);
+    }
+
+    for (size_t idx= 0; idx < counter; idx ++)
+    {
+        running_search_space[idx].query_ColumnNode-> done = false;
+        running_search_space[idx].candidate_ColumnNode-> done = false;
+    }
+
+    free(running_search_space);
+    return match_score;
+}
+
+/* a candidate table and its quantized score bound */
+struct TableBound {
+    size_t table;
+    double bound;
+};
+
+static int compareBoundsDesc(const void *a, const void *b) {
+    return compareValues(&((const struct TableBound *) b)->bound, &((const struct TableBound *) a)->bound);
+}
+
+void calculateSimilarities(int top_k)
 {
     struct ColumnNode *array_source_nodes = (struct ColumnNode *)malloc(num_query_attrs * sizeof(struct ColumnNode));
     struct ColumnNode *array_destination_nodes = (struct ColumnNode *)malloc(num_candidate_attrs * sizeof(struct ColumnNode));
@@ -666,55 +2251,86 @@ void calculateSimilarities()
         array_destination_nodes[i].done = false;
     }
 
+    size_t num_kept = Min((size_t) Max(top_k, 0), (size_t) size_of_num_columns_array);
 
-    for (size_t k = 0; k < size_of_num_columns_array; k++)
+    if (quantized_search && candidate_codes_array != NULL && num_kept > 0)
     {
-        struct Similarities *running_search_space = NULL;
-        int counter = 0;
-        for(size_t i = 0; i < num_query_attrs; i++)
+        /*
+         * Bound every table from the int8 arena, then score exactly in
+         * descending bound order. Once the k-th best exact score reaches the
+         * next bound (plus quantization slack) no remaining table can enter the
+         * top k, so the rest are not ranked.
+         */
+        struct QuantizedVector *query_codes = (struct QuantizedVector *)palloc(Max(num_query_attrs, 1) * sizeof(struct QuantizedVector));
+        struct TableBound *order = (struct TableBound *)palloc(size_of_num_columns_array * sizeof(struct TableBound));
+        double *top_scores = (double *)palloc(num_kept * sizeof(double));  // best exact scores so far, descending
+        size_t num_top = 0;
+        double slack = num_query_attrs * QUANTIZED_PAIR_SLACK;
+        bool pruned = false;
+
+        for (size_t i = 0; i < num_query_attrs; i++) {
+            quantizeEncoding(&query_encodings_array[i], &query_codes[i]);
+        }
+
+        for (size_t k = 0; k < size_of_num_columns_array; k++)
+        {
+            order[k].table = k;
+            order[k].bound = quantizedScoreBound(k, query_codes);
+        }
+        qsort(order, size_of_num_columns_array, sizeof(struct TableBound), compareBoundsDesc);
+
+        for (size_t r = 0; r < size_of_num_columns_array; r++)
         {
-            size_t start_idx = (k == 0) ? 0 : num_columns_array[k - 1];
-            
-            for(size_t j = start_idx; j < num_columns_array[k]; j++) 
+            size_t k = order[r].table;
+
+            pruned = pruned || (num_top == num_kept && top_scores[num_kept - 1] >= order[r].bound + slack);
+            if (pruned)
             {
-                if (strcmp(query_encodings_array[i].data_type, candidate_encodings_array[j].data_type) == 0)
-                {
-                    running_search_space = (struct Similarities *)realloc(running_search_space, (counter + 1) * sizeof(struct Similarities));
-                    if (!running_search_space) {
-                        elog(ERROR, "Memory allocation failed for running search space\n");
-                        exit(1);
-                    }
-                    running_search_space[counter].query_ColumnNode = &array_source_nodes[i];
-                    running_search_space[counter].candidate_ColumnNode = &array_destination_nodes[j];
-                    running_search_space[counter].similarity_score = cosineSimilarity(query_encodings_array[i].vector, candidate_encodings_array[j].vector, 9);
-                    counter++;
-                    
-                }
+                size_t start_idx = (k == 0) ? 0 : num_columns_array[k - 1];
+                table_ranks[k].table_name = start_idx < num_columns_array[k] ? candidate_encodings_array[start_idx].table_name : NULL;
+                table_ranks[k].match_score = -INFINITY;
+                continue;
             }
-        }
 
-        qsort(running_search_space, counter, sizeof(struct Similarities), compareSimilarity);
+            double score = scoreTable(k, array_source_nodes, array_destination_nodes, &table_ranks[k].table_name);
+            table_ranks[k].match_score = score;
 
-        if (counter > 0)
-        {
-            table_ranks[k].table_name = running_search_space[0].candidate_ColumnNode->table_name;
-            table_ranks[k].match_score  = findGreedyMatch(running_search_space, counter);
+            /* insert into the running top k */
+            if (num_top < num_kept) {
+                num_top++;
+            } else if (score <= top_scores[num_kept - 1]) {
+                continue;
+            }
+            size_t pos = num_top - 1;
+            while (pos > 0 && top_scores[pos - 1] < score) {
+                top_scores[pos] = top_scores[pos - 1];
+                pos--;
+            }
+            top_scores[pos] = score;
         }
-        else
-        {
-            table_ranks[k].table_name = NULL;
-            table_ranks[k].match_score  = -INFINITY;
+
+        pfree(query_codes);
+        pfree(order);
+        pfree(top_scores);
+    }
+    else
+            {
+                size_t start_idx = (k == 0) ? 0 : num_columns_array[k - 1];
+                table_ranks[k].table_name = start_idx < num_columns_array[k] ? candidate_encodings_array[start_idx].table_name : NULL;
+                table_ranks[k].match_score = -INFINITY;
+            }
         }
-        
 
-        for (size_t idx= 0; idx < counter; idx ++)
+        pfree(query_codes);
+        pfree(approx_scores);
+        pfree(sorted_scores);
+    }
+    else
+    {
+        for (size_t k = 0; k < size_of_num_columns_array; k++)
         {
-            running_search_space[idx].query_ColumnNode-> done = false;
-            running_search_space[idx].candidate_ColumnNode-> done = false;
+            table_ranks[k].match_score = scoreTable(k, array_source_nodes, array_destination_nodes, &table_ranks[k].table_name);
         }
-
-        free(running_search_space);
-        running_search_space = NULL;
     }
 
     // elog(INFO, "_____________UNRANKED TABLES__________________"); // UNCOMMENT
@@ -723,12 +2339,16 @@ void calculateSimilarities()
     //     elog(INFO, "( %s, %f )", table_ranks[k].table_name, table_ranks[k].match_score);
     // }
 
+    free(array_source_nodes);
+    free(array_destination_nodes);
+
     free(candidate_encodings_array);
     candidate_encodings_array = NULL;
 
+    free(candidate_codes_array);
+    candidate_codes_array = NULL;
+
     free(query_encodings_array);
     query_encodings_array = NULL;
 
 }
-
-